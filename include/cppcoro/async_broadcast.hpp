@@ -0,0 +1,716 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_ASYNC_BROADCAST_HPP_INCLUDED
+#define CPPCORO_ASYNC_BROADCAST_HPP_INCLUDED
+
+#include <cppcoro/epoch_reclamation.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	template<typename T>
+	class async_broadcast;
+
+	template<typename T>
+	class async_broadcast_subscriber;
+
+	/// \brief
+	/// Determines what an async_broadcast does when a subscriber falls more
+	/// than 'capacity' messages behind the producer.
+	enum class async_broadcast_policy
+	{
+		/// The producer overwrites the oldest message. The slow subscriber
+		/// skips the messages it missed, and is told how many it skipped.
+		lag,
+
+		/// The producer suspends until the slowest subscriber has
+		/// consumed the oldest message.
+		backpressure
+	};
+
+	/// \brief
+	/// A message received from an async_broadcast.
+	template<typename T>
+	class async_broadcast_message
+	{
+	public:
+
+		async_broadcast_message(T&& value, std::uint64_t skippedCount)
+			noexcept(std::is_nothrow_move_constructible_v<T>)
+			: m_value(std::move(value))
+			, m_skippedCount(skippedCount)
+		{}
+
+		async_broadcast_message(const T& value, std::uint64_t skippedCount)
+			noexcept(std::is_nothrow_copy_constructible_v<T>)
+			: m_value(value)
+			, m_skippedCount(skippedCount)
+		{}
+
+		T& value() & noexcept { return m_value; }
+		T&& value() && noexcept { return std::move(m_value); }
+
+		/// \brief
+		/// The number of messages that were overwritten before this
+		/// subscriber could receive them.
+		///
+		/// Always zero for a broadcast using async_broadcast_policy::backpressure.
+		std::uint64_t skipped_count() const noexcept { return m_skippedCount; }
+
+	private:
+
+		T m_value;
+		std::uint64_t m_skippedCount;
+
+	};
+
+	namespace detail
+	{
+		// A slot of the ring used with async_broadcast_policy::backpressure.
+		// The producer never overwrites a message a subscriber may still
+		// be copying, so the value is stored in place.
+		template<typename T>
+		struct async_broadcast_slot
+		{
+			T& value() noexcept { return *reinterpret_cast<T*>(&m_valueStorage); }
+
+			// Not using std::aligned_storage here due to bug in MSVC 2015 Update 2
+			// that means it doesn't work for types with alignof(T) > 8.
+			// See MS-Connect bug #2658635.
+			alignas(T) char m_valueStorage[sizeof(T)];
+		};
+
+		// A message in the ring used with async_broadcast_policy::lag.
+		// Never modified once published, and reclaimed with epoch_retire()
+		// once overwritten, so that subscribers can copy it out while the
+		// producer replaces it.
+		template<typename T>
+		struct async_broadcast_node
+		{
+			async_broadcast_node(std::uint64_t sequence, T&& value)
+				: m_sequence(sequence)
+				, m_value(std::move(value))
+			{}
+
+			const std::uint64_t m_sequence;
+			const T m_value;
+		};
+
+		template<typename T>
+		struct async_broadcast_subscriber_state
+		{
+			explicit async_broadcast_subscriber_state(std::uint64_t cursor) noexcept
+				: m_cursor(cursor)
+				, m_skippedCount(0)
+				, m_prev(nullptr)
+				, m_next(nullptr)
+				, m_nextWaiter(nullptr)
+			{}
+
+			// Sequence number of the next message this subscriber will receive.
+			std::atomic<std::uint64_t> m_cursor;
+
+			// Number of overwritten messages skipped since the last message
+			// was received. Only used with async_broadcast_policy::lag.
+			std::uint64_t m_skippedCount;
+
+			// The message received for the pending next() operation.
+			std::optional<async_broadcast_message<T>> m_message;
+
+			// Links in the broadcast's list of subscribers.
+			async_broadcast_subscriber_state* m_prev;
+			async_broadcast_subscriber_state* m_next;
+
+			// Link in the broadcast's list of subscribers waiting for a message.
+			async_broadcast_subscriber_state* m_nextWaiter;
+			std::experimental::coroutine_handle<> m_awaiter;
+		};
+	}
+
+	/// \brief
+	/// A multi-consumer broadcast channel in which every subscriber
+	/// receives every message.
+	///
+	/// Messages are written exactly once, into a single ring buffer with
+	/// 'capacity' slots. Each subscriber has its own cursor into the ring
+	/// and copies each message out of it when it is received, so the cost
+	/// to the producer does not grow with the number of subscribers.
+	///
+	/// There may only be a single producer coroutine calling publish() at a
+	/// time. Each subscriber may only be used by one coroutine at a time,
+	/// but different subscribers can be used concurrently from different
+	/// threads.
+	///
+	/// Receiving a message that is already available and publishing when
+	/// no subscriber is blocking the producer are lock-free. A mutex is
+	/// only taken on the paths that suspend a coroutine, or that resume one.
+	///
+	/// With async_broadcast_policy::lag each message is stored in its own
+	/// heap-allocated node. A subscriber copies the message out of the node
+	/// while the producer may already be replacing it, and the replaced node
+	/// is reclaimed with epoch_retire() once no subscriber can still be
+	/// copying it. The producer therefore never waits for subscribers.
+	/// With async_broadcast_policy::backpressure messages are stored in
+	/// place in the ring.
+	template<typename T>
+	class async_broadcast
+	{
+		using slot = detail::async_broadcast_slot<T>;
+		using node = detail::async_broadcast_node<T>;
+		using subscriber_state = detail::async_broadcast_subscriber_state<T>;
+
+	public:
+
+		/// \brief
+		/// Construct a broadcast channel that can buffer up to 'capacity'
+		/// messages for its slowest subscriber.
+		explicit async_broadcast(
+			std::size_t capacity,
+			async_broadcast_policy policy = async_broadcast_policy::lag)
+			: m_capacity(capacity)
+			, m_policy(policy)
+			, m_slots(policy == async_broadcast_policy::backpressure ? new slot[capacity] : nullptr)
+			, m_nodes(policy == async_broadcast_policy::lag ? new std::atomic<node*>[capacity] : nullptr)
+			, m_writeSequence(0)
+			, m_minCursor(0)
+			, m_subscribers(nullptr)
+			, m_waitingSubscribers(nullptr)
+			, m_hasWaitingSubscribers(false)
+			, m_producerWaiting(false)
+		{
+			assert(capacity > 0);
+
+			if (m_nodes)
+			{
+				for (std::size_t i = 0; i < capacity; ++i)
+				{
+					m_nodes[i].store(nullptr, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		/// Destroys the channel and any messages still buffered.
+		///
+		/// Behaviour is undefined if there are any subscribers still alive.
+		~async_broadcast()
+		{
+			assert(m_subscribers == nullptr);
+
+			if (m_nodes)
+			{
+				for (std::size_t i = 0; i < m_capacity; ++i)
+				{
+					delete m_nodes[i].load(std::memory_order_relaxed);
+				}
+
+				return;
+			}
+
+			const std::uint64_t end = m_writeSequence.load(std::memory_order_relaxed);
+			const std::uint64_t begin = end > m_capacity ? end - m_capacity : 0;
+			for (std::uint64_t sequence = begin; sequence < end; ++sequence)
+			{
+				m_slots[sequence % m_capacity].value().~T();
+			}
+		}
+
+		async_broadcast(const async_broadcast&) = delete;
+		async_broadcast& operator=(const async_broadcast&) = delete;
+
+		/// \brief
+		/// Subscribe to messages published from now on.
+		async_broadcast_subscriber<T> subscribe()
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+
+			auto* state = new subscriber_state{ m_writeSequence.load(std::memory_order_relaxed) };
+			state->m_next = m_subscribers;
+			if (m_subscribers != nullptr)
+			{
+				m_subscribers->m_prev = state;
+			}
+			m_subscribers = state;
+
+			return async_broadcast_subscriber<T>{ *this, state };
+		}
+
+		class publish_operation
+		{
+		public:
+
+			publish_operation(publish_operation&& other)
+				noexcept(std::is_nothrow_move_constructible_v<T>)
+				: m_broadcast(other.m_broadcast)
+				, m_value(std::move(other.m_value))
+				, m_written(other.m_written)
+			{}
+
+			bool await_ready()
+			{
+				m_written = m_broadcast.try_write(m_value);
+				return m_written;
+			}
+
+			bool await_suspend(std::experimental::coroutine_handle<> awaiter)
+			{
+				return m_broadcast.suspend_producer(awaiter);
+			}
+
+			void await_resume()
+			{
+				if (!m_written)
+				{
+					const bool written = m_broadcast.try_write(m_value);
+					assert(written);
+					(void)written;
+				}
+			}
+
+		private:
+
+			friend class async_broadcast<T>;
+
+			publish_operation(async_broadcast& broadcast, T&& value)
+				noexcept(std::is_nothrow_move_constructible_v<T>)
+				: m_broadcast(broadcast)
+				, m_value(std::move(value))
+				, m_written(false)
+			{}
+
+			async_broadcast& m_broadcast;
+			T m_value;
+			bool m_written;
+
+		};
+
+		/// \brief
+		/// Publish a message to all subscribers.
+		///
+		/// \return
+		/// An operation that must be co_await'ed. It completes synchronously
+		/// unless the policy is async_broadcast_policy::backpressure and the
+		/// slowest subscriber is 'capacity' messages behind, in which case
+		/// the producer is suspended until that subscriber catches up.
+		/// The producer is then resumed inside the subscriber's receive.
+		publish_operation publish(T value)
+		{
+			return publish_operation{ *this, std::move(value) };
+		}
+
+	private:
+
+		friend class async_broadcast_subscriber<T>;
+
+		/// Try to write the message into the ring.
+		///
+		/// \return
+		/// true if the message was written, false if the policy is
+		/// backpressure and the slot is still needed by some subscriber.
+		bool try_write(T& value)
+		{
+			const std::uint64_t sequence = m_writeSequence.load(std::memory_order_relaxed);
+
+			if (m_policy == async_broadcast_policy::backpressure &&
+				sequence >= m_minCursor + m_capacity)
+			{
+				// Cached lower bound on the subscribers' cursors says we may
+				// overwrite a message some subscriber hasn't received yet.
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				m_minCursor = min_cursor_locked();
+				if (sequence >= m_minCursor + m_capacity)
+				{
+					return false;
+				}
+			}
+
+			if (m_policy == async_broadcast_policy::lag)
+			{
+				// Subscribers may still be copying the message being replaced.
+				node* newNode = new node{ sequence, std::move(value) };
+				node* oldNode = m_nodes[sequence % m_capacity].exchange(newNode, std::memory_order_acq_rel);
+				if (oldNode != nullptr)
+				{
+					epoch_retire(oldNode);
+				}
+			}
+			else
+			{
+				slot& s = m_slots[sequence % m_capacity];
+				if (sequence >= m_capacity)
+				{
+					s.value().~T();
+				}
+
+				new (&s.m_valueStorage) T(std::move(value));
+			}
+
+			m_writeSequence.store(sequence + 1, std::memory_order_seq_cst);
+
+			if (m_hasWaitingSubscribers.load(std::memory_order_seq_cst))
+			{
+				resume_waiting_subscribers();
+			}
+
+			return true;
+		}
+
+		void resume_waiting_subscribers()
+		{
+			subscriber_state* waiters;
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				waiters = m_waitingSubscribers;
+				m_waitingSubscribers = nullptr;
+				m_hasWaitingSubscribers.store(false, std::memory_order_relaxed);
+			}
+
+			while (waiters != nullptr)
+			{
+				// Read the next pointer before resuming since the resumed
+				// coroutine may wait again, and relink this subscriber.
+				auto* next = waiters->m_nextWaiter;
+
+				// Receive on the subscriber's behalf, as it can't suspend
+				// again once resumed. It may have to wait for another message
+				// if it skipped past messages that are being overwritten.
+				if (try_receive(*waiters) ||
+					!suspend_subscriber(*waiters, waiters->m_awaiter))
+				{
+					waiters->m_awaiter.resume();
+				}
+
+				waiters = next;
+			}
+		}
+
+		/// \return
+		/// true if the producer was suspended, false if it is now able to
+		/// write the message and should continue without suspending.
+		bool suspend_producer(std::experimental::coroutine_handle<> awaiter)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+
+			m_producer = awaiter;
+			m_producerWaiting.store(true, std::memory_order_seq_cst);
+
+			m_minCursor = min_cursor_locked();
+			const std::uint64_t sequence = m_writeSequence.load(std::memory_order_relaxed);
+			if (sequence >= m_minCursor + m_capacity)
+			{
+				return true;
+			}
+
+			m_producerWaiting.store(false, std::memory_order_relaxed);
+			return false;
+		}
+
+		/// Called by a subscriber after it advanced its cursor or unsubscribed.
+		void notify_producer_if_unblocked()
+		{
+			if (!m_producerWaiting.load(std::memory_order_seq_cst))
+			{
+				return;
+			}
+
+			std::experimental::coroutine_handle<> producer;
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				if (!m_producerWaiting.load(std::memory_order_relaxed))
+				{
+					return;
+				}
+
+				m_minCursor = min_cursor_locked();
+				const std::uint64_t sequence = m_writeSequence.load(std::memory_order_relaxed);
+				if (sequence >= m_minCursor + m_capacity)
+				{
+					return;
+				}
+
+				m_producerWaiting.store(false, std::memory_order_relaxed);
+				producer = m_producer;
+			}
+
+			producer.resume();
+		}
+
+		/// \return
+		/// true if the subscriber was queued to be resumed when the next
+		/// message is published, false if a message has been received into
+		/// state.m_message and the subscriber should continue without
+		/// suspending.
+		bool suspend_subscriber(
+			subscriber_state& state,
+			std::experimental::coroutine_handle<> awaiter)
+		{
+			while (true)
+			{
+				{
+					std::lock_guard<std::mutex> lock{ m_mutex };
+
+					m_hasWaitingSubscribers.store(true, std::memory_order_seq_cst);
+
+					if (state.m_cursor.load(std::memory_order_relaxed) >=
+						m_writeSequence.load(std::memory_order_seq_cst))
+					{
+						state.m_awaiter = awaiter;
+						state.m_nextWaiter = m_waitingSubscribers;
+						m_waitingSubscribers = &state;
+						return true;
+					}
+				}
+
+				if (try_receive(state))
+				{
+					return false;
+				}
+			}
+		}
+
+		/// \brief
+		/// Copy the next message for this subscriber into state.m_message.
+		///
+		/// \return
+		/// false if there is no message to receive yet. With the lag policy
+		/// the number of messages skipped so far is kept in the subscriber's
+		/// state so that it can be reported with the next message received.
+		bool try_receive(subscriber_state& state)
+		{
+			std::uint64_t cursor = state.m_cursor.load(std::memory_order_relaxed);
+
+			if (m_policy == async_broadcast_policy::backpressure)
+			{
+				if (cursor >= m_writeSequence.load(std::memory_order_acquire))
+				{
+					return false;
+				}
+
+				slot& s = m_slots[cursor % m_capacity];
+				state.m_message.emplace(s.value(), 0);
+				state.m_cursor.store(cursor + 1, std::memory_order_seq_cst);
+				notify_producer_if_unblocked();
+				return true;
+			}
+
+			// Keeps the node being copied from being reclaimed if the
+			// producer replaces it meanwhile.
+			epoch_guard guard;
+
+			std::uint64_t skipped = state.m_skippedCount;
+			while (true)
+			{
+				const std::uint64_t writeSequence = m_writeSequence.load(std::memory_order_acquire);
+				if (cursor >= writeSequence)
+				{
+					state.m_cursor.store(cursor, std::memory_order_relaxed);
+					state.m_skippedCount = skipped;
+					return false;
+				}
+
+				if (writeSequence - cursor > m_capacity)
+				{
+					// The messages have already been overwritten.
+					skipped += writeSequence - m_capacity - cursor;
+					cursor = writeSequence - m_capacity;
+				}
+
+				// The node for 'cursor' was stored before m_writeSequence was
+				// advanced past it, so this is either it or a later message.
+				const node* n = m_nodes[cursor % m_capacity].load(std::memory_order_acquire);
+				assert(n != nullptr && n->m_sequence >= cursor);
+				if (n->m_sequence == cursor)
+				{
+					state.m_message.emplace(n->m_value, skipped);
+					state.m_cursor.store(cursor + 1, std::memory_order_relaxed);
+					state.m_skippedCount = 0;
+					return true;
+				}
+
+				// The producer has overwritten this message since
+				// m_writeSequence was read.
+				++skipped;
+				++cursor;
+			}
+		}
+
+		/// Take the message received by try_receive().
+		async_broadcast_message<T> take_message(subscriber_state& state)
+		{
+			assert(state.m_message);
+			async_broadcast_message<T> message = std::move(*state.m_message);
+			state.m_message.reset();
+			return message;
+		}
+
+		void unsubscribe(subscriber_state* state)
+		{
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+
+				if (state->m_prev != nullptr)
+				{
+					state->m_prev->m_next = state->m_next;
+				}
+				else
+				{
+					m_subscribers = state->m_next;
+				}
+
+				if (state->m_next != nullptr)
+				{
+					state->m_next->m_prev = state->m_prev;
+				}
+			}
+
+			delete state;
+
+			if (m_policy == async_broadcast_policy::backpressure)
+			{
+				notify_producer_if_unblocked();
+			}
+		}
+
+		std::uint64_t min_cursor_locked() const noexcept
+		{
+			std::uint64_t result = m_writeSequence.load(std::memory_order_relaxed);
+			for (auto* state = m_subscribers; state != nullptr; state = state->m_next)
+			{
+				result = (std::min)(result, state->m_cursor.load(std::memory_order_seq_cst));
+			}
+			return result;
+		}
+
+		const std::size_t m_capacity;
+		const async_broadcast_policy m_policy;
+		// Only used with async_broadcast_policy::backpressure.
+		const std::unique_ptr<slot[]> m_slots;
+
+		// Only used with async_broadcast_policy::lag.
+		const std::unique_ptr<std::atomic<node*>[]> m_nodes;
+
+		// Sequence number of the next message to be published.
+		std::atomic<std::uint64_t> m_writeSequence;
+
+		// Lower bound on the cursors of all subscribers.
+		// Only accessed by the producer or with m_mutex held.
+		std::uint64_t m_minCursor;
+
+		std::mutex m_mutex;
+		subscriber_state* m_subscribers;
+		subscriber_state* m_waitingSubscribers;
+		std::atomic<bool> m_hasWaitingSubscribers;
+		std::atomic<bool> m_producerWaiting;
+		std::experimental::coroutine_handle<> m_producer;
+
+	};
+
+	/// \brief
+	/// A subscription to an async_broadcast<T>.
+	///
+	/// Unsubscribes when destroyed. Behaviour is undefined if it is destroyed
+	/// while a coroutine is waiting on next().
+	template<typename T>
+	class async_broadcast_subscriber
+	{
+		using subscriber_state = detail::async_broadcast_subscriber_state<T>;
+
+	public:
+
+		class next_operation
+		{
+		public:
+
+			bool await_ready()
+			{
+				return m_subscriber.m_broadcast->try_receive(*m_subscriber.m_state);
+			}
+
+			bool await_suspend(std::experimental::coroutine_handle<> awaiter)
+			{
+				return m_subscriber.m_broadcast->suspend_subscriber(*m_subscriber.m_state, awaiter);
+			}
+
+			async_broadcast_message<T> await_resume()
+			{
+				return m_subscriber.m_broadcast->take_message(*m_subscriber.m_state);
+			}
+
+		private:
+
+			friend class async_broadcast_subscriber<T>;
+
+			explicit next_operation(async_broadcast_subscriber& subscriber) noexcept
+				: m_subscriber(subscriber)
+			{}
+
+			async_broadcast_subscriber& m_subscriber;
+
+		};
+
+		async_broadcast_subscriber(async_broadcast_subscriber&& other) noexcept
+			: m_broadcast(other.m_broadcast)
+			, m_state(other.m_state)
+		{
+			other.m_state = nullptr;
+		}
+
+		async_broadcast_subscriber(const async_broadcast_subscriber&) = delete;
+		async_broadcast_subscriber& operator=(const async_broadcast_subscriber&) = delete;
+
+		~async_broadcast_subscriber()
+		{
+			if (m_state != nullptr)
+			{
+				m_broadcast->unsubscribe(m_state);
+			}
+		}
+
+		/// Query whether a message is available to receive without suspending.
+		bool available() const noexcept
+		{
+			return m_state->m_cursor.load(std::memory_order_relaxed) <
+				m_broadcast->m_writeSequence.load(std::memory_order_acquire);
+		}
+
+		/// \brief
+		/// Receive the next message.
+		///
+		/// \return
+		/// An operation that must be co_await'ed. The result of the co_await
+		/// expression is an async_broadcast_message<T> holding a copy of
+		/// the message.
+		next_operation next() noexcept
+		{
+			return next_operation{ *this };
+		}
+
+	private:
+
+		friend class async_broadcast<T>;
+
+		async_broadcast_subscriber(async_broadcast<T>& broadcast, subscriber_state* state) noexcept
+			: m_broadcast(&broadcast)
+			, m_state(state)
+		{}
+
+		async_broadcast<T>* m_broadcast;
+		subscriber_state* m_state;
+
+	};
+}
+
+#endif
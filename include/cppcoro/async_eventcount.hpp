@@ -0,0 +1,150 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_ASYNC_EVENTCOUNT_HPP_INCLUDED
+#define CPPCORO_ASYNC_EVENTCOUNT_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	class async_eventcount_wait_operation;
+
+	/// \brief
+	/// Lets coroutines wait for a condition on some lock-free data structure
+	/// to become true without any lost-wakeup races.
+	///
+	/// A consumer calls prepare_wait(), re-checks the condition (eg. tries to
+	/// pop from the queue again) and then either calls cancel_wait() if the
+	/// condition is now true or co_awaits commit_wait() to suspend until the
+	/// next notification. Any notification after prepare_wait() returned
+	/// causes commit_wait() to complete without suspending.
+	///
+	/// A producer makes the change and then calls notify_one() or
+	/// notify_all(). When no consumer is waiting, notifying costs a single
+	/// atomic load. For this to be race-free the change must be made using a
+	/// sequentially-consistent atomic operation (the default memory order),
+	/// such as the compare_exchange or fetch_add that pushes onto the queue.
+	///
+	/// Consumers must be prepared for spurious wake-ups and re-check the
+	/// condition after commit_wait() completes.
+	class async_eventcount
+	{
+	public:
+
+		using key_type = std::uint32_t;
+
+		async_eventcount() noexcept;
+
+		/// Destroys the eventcount. There must be no waiters.
+		~async_eventcount();
+
+		async_eventcount(const async_eventcount&) = delete;
+		async_eventcount& operator=(const async_eventcount&) = delete;
+
+		/// \brief
+		/// Register intent to wait.
+		///
+		/// Must be followed by either cancel_wait() or co_await commit_wait().
+		///
+		/// \return
+		/// A key to pass to commit_wait().
+		key_type prepare_wait() noexcept
+		{
+			const std::uint64_t oldState = m_state.fetch_add(1, std::memory_order_seq_cst);
+			return static_cast<key_type>(oldState >> epoch_shift);
+		}
+
+		/// Abandon a wait started with prepare_wait().
+		void cancel_wait() noexcept
+		{
+			m_state.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		/// \brief
+		/// Wait for a notification after the call to prepare_wait() that
+		/// returned 'key'.
+		///
+		/// \return
+		/// An operation that must be co_await'ed. If there has already been
+		/// a notification then it completes without suspending. Otherwise the
+		/// awaiting coroutine is resumed inside the next call to notify_one()
+		/// or notify_all() (or queued on the notifying thread's
+		/// local_run_loop, if it is capturing resumptions).
+		async_eventcount_wait_operation commit_wait(key_type key) noexcept;
+
+		/// Wake up at most one waiting coroutine.
+		void notify_one() noexcept
+		{
+			if ((m_state.load(std::memory_order_seq_cst) & waiter_count_mask) != 0)
+			{
+				notify_slow(false);
+			}
+		}
+
+		/// Wake up all waiting coroutines.
+		void notify_all() noexcept
+		{
+			if ((m_state.load(std::memory_order_seq_cst) & waiter_count_mask) != 0)
+			{
+				notify_slow(true);
+			}
+		}
+
+	private:
+
+		friend class async_eventcount_wait_operation;
+
+		// State is (epoch << 32) | waiterCount.
+		// The waiter count includes prepared as well as suspended waiters.
+		static constexpr int epoch_shift = 32;
+		static constexpr std::uint64_t waiter_count_mask = (std::uint64_t(1) << epoch_shift) - 1;
+		static constexpr std::uint64_t epoch_increment = std::uint64_t(1) << epoch_shift;
+
+		void notify_slow(bool notifyAll) noexcept;
+
+		std::atomic<std::uint64_t> m_state;
+
+		// Suspended waiters, in FIFO order.
+		std::mutex m_mutex;
+		async_eventcount_wait_operation* m_head;
+		async_eventcount_wait_operation* m_tail;
+
+	};
+
+	class async_eventcount_wait_operation
+	{
+	public:
+
+		bool await_ready() noexcept;
+		bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept;
+		void await_resume() const noexcept {}
+
+	private:
+
+		friend class async_eventcount;
+
+		async_eventcount_wait_operation(async_eventcount& eventcount, async_eventcount::key_type key) noexcept
+			: m_eventcount(eventcount)
+			, m_key(key)
+		{}
+
+		async_eventcount& m_eventcount;
+		async_eventcount::key_type m_key;
+		async_eventcount_wait_operation* m_next;
+		std::experimental::coroutine_handle<> m_awaiter;
+
+	};
+
+	inline async_eventcount_wait_operation async_eventcount::commit_wait(key_type key) noexcept
+	{
+		return async_eventcount_wait_operation{ *this, key };
+	}
+}
+
+#endif
@@ -72,7 +72,8 @@ namespace cppcoro
 		///
 		/// If there are lock operations waiting to acquire the
 		/// mutex then the next lock operation in the queue will
-		/// be resumed inside this call.
+		/// be resumed inside this call, or queued on the current
+		/// thread's local_run_loop if it is capturing resumptions.
 		void unlock();
 
 	private:
@@ -0,0 +1,401 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_ASYNC_WATCH_HPP_INCLUDED
+#define CPPCORO_ASYNC_WATCH_HPP_INCLUDED
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	template<typename T>
+	class async_watch;
+
+	namespace detail
+	{
+		template<typename T>
+		struct async_watch_node
+		{
+			async_watch_node(std::uint64_t version, T&& value)
+				: m_value(std::move(value))
+				, m_version(version)
+				, m_refCount(1)
+				, m_waiters(nullptr)
+			{}
+
+			void add_ref() noexcept
+			{
+				m_refCount.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			void release() noexcept
+			{
+				if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					delete this;
+				}
+			}
+
+			const T m_value;
+			const std::uint64_t m_version;
+			std::atomic<std::uint32_t> m_refCount;
+
+			// Value is either
+			// - nullptr - no waiters
+			// - this - a newer version has been published
+			// - other - pointer to head of linked-list of waiting
+			//           async_watch<T>::next_operation objects.
+			std::atomic<void*> m_waiters;
+		};
+	}
+
+	/// \brief
+	/// A reference to one published version of the value of an async_watch<T>.
+	///
+	/// Holds the value alive even if newer versions are published.
+	template<typename T>
+	class async_watch_snapshot
+	{
+	public:
+
+		async_watch_snapshot(async_watch_snapshot&& other) noexcept
+			: m_node(other.m_node)
+		{
+			other.m_node = nullptr;
+		}
+
+		async_watch_snapshot(const async_watch_snapshot& other) noexcept
+			: m_node(other.m_node)
+		{
+			if (m_node != nullptr)
+			{
+				m_node->add_ref();
+			}
+		}
+
+		~async_watch_snapshot()
+		{
+			if (m_node != nullptr)
+			{
+				m_node->release();
+			}
+		}
+
+		async_watch_snapshot& operator=(async_watch_snapshot other) noexcept
+		{
+			std::swap(m_node, other.m_node);
+			return *this;
+		}
+
+		/// The version number of this value.
+		///
+		/// Pass this to async_watch<T>::next() to wait for a newer value.
+		std::uint64_t version() const noexcept { return m_node->m_version; }
+
+		const T& value() const noexcept { return m_node->m_value; }
+		const T& operator*() const noexcept { return m_node->m_value; }
+		const T* operator->() const noexcept { return &m_node->m_value; }
+
+	private:
+
+		friend class async_watch<T>;
+
+		explicit async_watch_snapshot(detail::async_watch_node<T>* node) noexcept
+			: m_node(node)
+		{}
+
+		detail::async_watch_node<T>* m_node;
+
+	};
+
+	/// \brief
+	/// Holds the latest value of some piece of state and lets coroutines
+	/// wait for it to change.
+	///
+	/// Each call to publish() stores a new version of the value. Subscribers
+	/// remember the version they last saw and co_await next(version) to be
+	/// resumed when a newer version is available. A subscriber always sees
+	/// the latest value; intermediate versions published while it was busy
+	/// are skipped.
+	///
+	/// Reading the current value is wait-free. Publishing swaps a pointer to
+	/// the new value and then waits for a grace period until no reader can
+	/// still be looking at the old pointer (readers never suspend while doing
+	/// so, so this wait is short). Calls to publish() are serialised.
+	///
+	/// Waiting coroutines are queued on the version they are waiting to be
+	/// superseded, and are resumed inside the call to publish() that
+	/// supersedes it.
+	template<typename T>
+	class async_watch
+	{
+		using node = detail::async_watch_node<T>;
+
+	public:
+
+		using version_type = std::uint64_t;
+
+		/// \brief
+		/// Construct the watch with an initial value, which has version 1.
+		///
+		/// Passing version 0 to next() will therefore always complete
+		/// synchronously.
+		explicit async_watch(T initialValue)
+			: m_current(new node{ 1, std::move(initialValue) })
+			, m_epoch(0)
+		{
+			m_readers[0].store(0, std::memory_order_relaxed);
+			m_readers[1].store(0, std::memory_order_relaxed);
+		}
+
+		/// Destroys the watch.
+		///
+		/// Behaviour is undefined if there are any outstanding coroutines
+		/// waiting on next().
+		~async_watch()
+		{
+			node* current = m_current.load(std::memory_order_relaxed);
+			assert(current->m_waiters.load(std::memory_order_relaxed) == nullptr);
+			current->release();
+		}
+
+		async_watch(const async_watch&) = delete;
+		async_watch& operator=(const async_watch&) = delete;
+
+		/// The version number of the current value.
+		version_type version() const noexcept
+		{
+			return current().version();
+		}
+
+		/// Obtain a reference to the current value.
+		async_watch_snapshot<T> current() const noexcept
+		{
+			return async_watch_snapshot<T>{ acquire_current() };
+		}
+
+		/// \brief
+		/// Publish a new version of the value.
+		///
+		/// Any coroutines waiting for a version newer than the current one
+		/// are resumed inside this call.
+		void publish(T value)
+		{
+			node* oldNode;
+			{
+				std::lock_guard<std::mutex> lock{ m_publishMutex };
+
+				oldNode = m_current.load(std::memory_order_relaxed);
+				node* newNode = new node{ oldNode->m_version + 1, std::move(value) };
+				m_current.store(newNode, std::memory_order_seq_cst);
+
+				wait_for_readers();
+			}
+
+			// No reader can be about to add a reference to oldNode now, so
+			// the list of waiters can be closed and the watch's reference
+			// dropped once they have been resumed.
+			void* waiters = oldNode->m_waiters.exchange(
+				static_cast<void*>(oldNode), std::memory_order_acq_rel);
+			while (waiters != nullptr)
+			{
+				// Read the m_next pointer before resuming the coroutine
+				// since resuming the coroutine may destroy the operation.
+				auto* waiter = static_cast<next_operation*>(waiters);
+				waiters = waiter->m_next;
+				waiter->on_superseded();
+			}
+
+			oldNode->release();
+		}
+
+		class next_operation
+		{
+		public:
+
+			next_operation(next_operation&& other) noexcept
+				: m_watch(other.m_watch)
+				, m_lastSeenVersion(other.m_lastSeenVersion)
+				, m_node(other.m_node)
+			{
+				other.m_node = nullptr;
+			}
+
+			~next_operation()
+			{
+				if (m_node != nullptr)
+				{
+					m_node->release();
+				}
+			}
+
+			bool await_ready() noexcept
+			{
+				m_node = m_watch.acquire_current();
+				return m_node->m_version > m_lastSeenVersion;
+			}
+
+			bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+			{
+				m_awaiter = awaiter;
+				return try_wait();
+			}
+
+			async_watch_snapshot<T> await_resume() noexcept
+			{
+				node* result = m_node;
+				m_node = nullptr;
+				assert(result->m_version > m_lastSeenVersion);
+				return async_watch_snapshot<T>{ result };
+			}
+
+		private:
+
+			friend class async_watch<T>;
+
+			/// Add this operation to the waiters of m_node.
+			///
+			/// \return
+			/// false if m_node has already been superseded.
+			bool try_enqueue() noexcept
+			{
+				void* oldWaiters = m_node->m_waiters.load(std::memory_order_acquire);
+				do
+				{
+					if (oldWaiters == static_cast<void*>(m_node))
+					{
+						return false;
+					}
+
+					m_next = static_cast<next_operation*>(oldWaiters);
+				} while (!m_node->m_waiters.compare_exchange_weak(
+					oldWaiters,
+					static_cast<void*>(this),
+					std::memory_order_release,
+					std::memory_order_acquire));
+
+				return true;
+			}
+
+			/// \brief
+			/// Wait on m_node, moving on to the latest node whenever it has
+			/// been superseded, until a version newer than m_lastSeenVersion
+			/// is current.
+			///
+			/// A superseding version need not be newer than m_lastSeenVersion
+			/// if the caller passed a version it has not actually seen yet.
+			///
+			/// \return
+			/// true if the operation was queued and will be notified by
+			/// publish(), false if m_node now refers to a newer version.
+			bool try_wait() noexcept
+			{
+				while (!try_enqueue())
+				{
+					node* latest = m_watch.acquire_current();
+					m_node->release();
+					m_node = latest;
+
+					if (latest->m_version > m_lastSeenVersion)
+					{
+						return false;
+					}
+				}
+
+				return true;
+			}
+
+			/// Called by publish() once m_node has been superseded.
+			void on_superseded() noexcept
+			{
+				if (!try_wait())
+				{
+					m_awaiter.resume();
+				}
+			}
+
+			next_operation(const async_watch& watch, version_type lastSeenVersion) noexcept
+				: m_watch(watch)
+				, m_lastSeenVersion(lastSeenVersion)
+				, m_node(nullptr)
+			{}
+
+			const async_watch& m_watch;
+			version_type m_lastSeenVersion;
+			node* m_node;
+			next_operation* m_next;
+			std::experimental::coroutine_handle<> m_awaiter;
+
+		};
+
+		/// \brief
+		/// Wait until a version newer than 'lastSeenVersion' is published.
+		///
+		/// If 'lastSeenVersion' is ahead of the current version, the awaiting
+		/// coroutine stays suspended across intermediate versions until one
+		/// newer than 'lastSeenVersion' is published.
+		///
+		/// \return
+		/// An operation that must be co_await'ed. The result of the co_await
+		/// expression is a snapshot of the latest value, whose version()
+		/// is greater than 'lastSeenVersion'.
+		next_operation next(version_type lastSeenVersion) const noexcept
+		{
+			return next_operation{ *this, lastSeenVersion };
+		}
+
+	private:
+
+		/// Read the current node and add a reference to it.
+		///
+		/// This is wait-free. The reader registers itself in the reader
+		/// count for the current epoch for the few instructions between
+		/// loading the pointer and adding the reference so that publish()
+		/// knows not to release the node underneath it.
+		node* acquire_current() const noexcept
+		{
+			const std::uint32_t epoch = m_epoch.load(std::memory_order_acquire) & 1;
+			m_readers[epoch].fetch_add(1, std::memory_order_seq_cst);
+			node* current = m_current.load(std::memory_order_seq_cst);
+			current->add_ref();
+			m_readers[epoch].fetch_sub(1, std::memory_order_release);
+			return current;
+		}
+
+		/// Wait until every reader that may have loaded the previous value
+		/// of m_current has finished adding its reference to it.
+		///
+		/// Readers are split into two counts by epoch parity. Flipping the
+		/// epoch sends new readers to the other count so that the count
+		/// being waited on is guaranteed to drain. Both counts must drain
+		/// since a reader may have sampled the epoch before an earlier flip.
+		void wait_for_readers() noexcept
+		{
+			for (int phase = 0; phase < 2; ++phase)
+			{
+				const std::uint32_t oldEpoch =
+					m_epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+				while (m_readers[oldEpoch].load(std::memory_order_acquire) != 0)
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		std::atomic<node*> m_current;
+		std::atomic<std::uint32_t> m_epoch;
+		mutable std::atomic<std::uint32_t> m_readers[2];
+		std::mutex m_publishMutex;
+
+	};
+}
+
+#endif
@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_ATOMIC_WAIT_HPP_INCLUDED
+#define CPPCORO_ATOMIC_WAIT_HPP_INCLUDED
+
+#include <atomic>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	namespace detail
+	{
+		/// \brief
+		/// A coroutine waiting in the global parking lot.
+		///
+		/// Waiters are queued in one of a fixed number of buckets chosen by
+		/// hashing the address being waited on, so no storage is needed in
+		/// the object being waited on.
+		struct parking_lot_waiter
+		{
+			using validate_func = bool(*)(parking_lot_waiter* waiter) noexcept;
+
+			const void* m_address;
+
+			// Called with the bucket locked. Returns false if the waiter
+			// should not be parked after all.
+			validate_func m_validate;
+
+			parking_lot_waiter* m_next;
+			std::experimental::coroutine_handle<> m_awaiter;
+		};
+
+		/// \brief
+		/// Queue 'waiter' on its address if its m_validate() still returns true.
+		///
+		/// \return
+		/// true if the waiter was queued and will be resumed by a later call
+		/// to atomic_notify_one() or atomic_notify_all().
+		bool parking_lot_park(parking_lot_waiter* waiter) noexcept;
+	}
+
+	/// \brief
+	/// An operation that suspends the awaiting coroutine until the value of
+	/// an atomic is no longer equal to a given value.
+	template<typename T>
+	class atomic_wait_operation : private detail::parking_lot_waiter
+	{
+	public:
+
+		atomic_wait_operation(const std::atomic<T>& atomic, T old) noexcept
+			: m_atomic(atomic)
+			, m_old(old)
+		{
+			m_address = &atomic;
+			m_validate = &atomic_wait_operation::still_equal;
+		}
+
+		// Only valid before the operation has been awaited.
+		atomic_wait_operation(const atomic_wait_operation& other) noexcept
+			: atomic_wait_operation(other.m_atomic, other.m_old)
+		{}
+
+		bool await_ready() const noexcept
+		{
+			return m_atomic.load(std::memory_order_acquire) != m_old;
+		}
+
+		bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+		{
+			m_awaiter = awaiter;
+			return detail::parking_lot_park(this);
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+
+		static bool still_equal(detail::parking_lot_waiter* waiter) noexcept
+		{
+			auto* self = static_cast<atomic_wait_operation*>(waiter);
+			return self->m_atomic.load(std::memory_order_seq_cst) == self->m_old;
+		}
+
+		const std::atomic<T>& m_atomic;
+		const T m_old;
+
+	};
+
+	/// \brief
+	/// Wait until the value of 'atomic' is no longer equal to 'old'.
+	///
+	/// The coroutine-based equivalent of std::atomic<T>::wait(). The awaiting
+	/// coroutine is suspended until another thread changes the value and
+	/// calls atomic_notify_one() or atomic_notify_all() with its address.
+	/// It is then resumed inside that call (or queued on the notifying
+	/// thread's local_run_loop, if it is capturing resumptions).
+	///
+	/// As with std::atomic<T>::wait(), the operation may complete without
+	/// the value having changed (eg. if it changed and changed back), so
+	/// callers should re-check the condition they are waiting for.
+	///
+	/// \return
+	/// An operation that must be co_await'ed.
+	template<typename T>
+	atomic_wait_operation<T> atomic_wait(const std::atomic<T>& atomic, T old) noexcept
+	{
+		return atomic_wait_operation<T>{ atomic, old };
+	}
+
+	/// \brief
+	/// Resume one coroutine waiting in atomic_wait() on the atomic at
+	/// 'address', if any.
+	///
+	/// Costs a fence and an atomic load if no coroutines are waiting on any
+	/// address that hashes to the same bucket.
+	void atomic_notify_one(const void* address) noexcept;
+
+	/// \brief
+	/// Resume all coroutines waiting in atomic_wait() on the atomic at
+	/// 'address'.
+	void atomic_notify_all(const void* address) noexcept;
+}
+
+#endif
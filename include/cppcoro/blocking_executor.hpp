@@ -0,0 +1,348 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_BLOCKING_EXECUTOR_HPP_INCLUDED
+#define CPPCORO_BLOCKING_EXECUTOR_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	class blocking_executor;
+
+	namespace detail
+	{
+		class blocking_operation
+		{
+		protected:
+
+			using execute_func = void(*)(blocking_operation* operation) noexcept;
+			using resume_func = void(*)(blocking_operation* operation) noexcept;
+
+			blocking_operation(execute_func execute, resume_func resume) noexcept
+				: m_execute(execute)
+				, m_resume(resume)
+				, m_next(nullptr)
+			{}
+
+		private:
+
+			friend class cppcoro::blocking_executor;
+
+			execute_func m_execute;
+			resume_func m_resume;
+			blocking_operation* m_next;
+			std::chrono::steady_clock::time_point m_enqueueTime;
+
+		protected:
+
+			std::experimental::coroutine_handle<> m_awaiter;
+
+		};
+
+		/// Resumes the awaiting coroutine inline, on the executor thread.
+		struct resume_inline
+		{
+			void operator()(std::experimental::coroutine_handle<> awaiter) const noexcept
+			{
+				awaiter.resume();
+			}
+		};
+
+		template<typename T>
+		class offload_result
+		{
+		public:
+
+			offload_result() noexcept
+				: m_hasValue(false)
+			{}
+
+			~offload_result()
+			{
+				if (m_hasValue)
+				{
+					reinterpret_cast<T*>(&m_valueStorage)->~T();
+				}
+			}
+
+			template<typename FUNC>
+			void set(FUNC& func)
+			{
+				::new (static_cast<void*>(&m_valueStorage)) T(func());
+				m_hasValue = true;
+			}
+
+			T get()
+			{
+				return std::move(*reinterpret_cast<T*>(&m_valueStorage));
+			}
+
+		private:
+
+			// Not using std::aligned_storage here due to bug in MSVC 2015 Update 2
+			// that means it doesn't work for types with alignof(T) > 8.
+			// See MS-Connect bug #2658635.
+			alignas(T) char m_valueStorage[sizeof(T)];
+			bool m_hasValue;
+
+		};
+
+		template<typename T>
+		class offload_result<T&>
+		{
+		public:
+
+			template<typename FUNC>
+			void set(FUNC& func)
+			{
+				m_value = std::addressof(func());
+			}
+
+			T& get() noexcept
+			{
+				return *m_value;
+			}
+
+		private:
+
+			T* m_value;
+
+		};
+
+		template<>
+		class offload_result<void>
+		{
+		public:
+
+			template<typename FUNC>
+			void set(FUNC& func)
+			{
+				func();
+			}
+
+			void get() noexcept {}
+
+		};
+	}
+
+	/// \brief
+	/// A bounded pool of threads for running calls that block.
+	///
+	/// Some calls can't be made asynchronous (legacy libraries, getpwnam(),
+	/// heavy compression). Running them through offload() keeps them off
+	/// event-loop threads. The pool has a fixed number of threads; once they
+	/// are all busy further work is queued in FIFO order.
+	///
+	/// The executor records queue depth, busy threads and the time spent
+	/// queued and running so that saturation can be detected.
+	class blocking_executor
+	{
+	public:
+
+		struct statistics
+		{
+			/// Number of calls waiting for a thread.
+			std::size_t queueDepth;
+
+			/// Number of threads currently running a call.
+			std::uint32_t busyThreadCount;
+
+			/// Number of calls that have completed.
+			std::uint64_t completedCount;
+
+			/// Total time completed calls spent waiting for a thread.
+			std::chrono::nanoseconds totalQueueTime;
+
+			/// Total time completed calls spent running.
+			std::chrono::nanoseconds totalRunTime;
+		};
+
+		/// Start 'threadCount' threads to run blocking calls on.
+		explicit blocking_executor(std::uint32_t threadCount = 4);
+
+		/// \brief
+		/// Waits for all queued calls to complete and then joins the threads.
+		///
+		/// Must not be called from one of the executor's threads.
+		~blocking_executor();
+
+		blocking_executor(const blocking_executor&) = delete;
+		blocking_executor& operator=(const blocking_executor&) = delete;
+
+		std::uint32_t thread_count() const noexcept
+		{
+			return static_cast<std::uint32_t>(m_threads.size());
+		}
+
+		/// Take a snapshot of the executor's statistics.
+		statistics stats() const noexcept;
+
+	private:
+
+		template<typename FUNC, typename RESUMER>
+		friend class offload_operation;
+
+		void schedule(detail::blocking_operation* operation) noexcept;
+
+		void run_worker() noexcept;
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_wakeUp;
+		detail::blocking_operation* m_head;
+		detail::blocking_operation* m_tail;
+		std::size_t m_queueDepth;
+		bool m_stopping;
+
+		std::atomic<std::uint32_t> m_busyThreadCount;
+		std::atomic<std::uint64_t> m_completedCount;
+		std::atomic<std::int64_t> m_totalQueueTime;
+		std::atomic<std::int64_t> m_totalRunTime;
+
+		std::vector<std::thread> m_threads;
+
+	};
+
+	/// \brief
+	/// An operation that runs a function on a blocking_executor thread.
+	///
+	/// The result of the co_await expression is the value returned by
+	/// the function, or the exception it threw is rethrown.
+	///
+	/// Once the function has returned, the executor thread passes the
+	/// awaiting coroutine's handle to the RESUMER, which must resume it
+	/// (now or later, on any thread) and must not throw.
+	template<typename FUNC, typename RESUMER = detail::resume_inline>
+	class offload_operation : private detail::blocking_operation
+	{
+		using result_type = decltype(std::declval<FUNC&>()());
+
+	public:
+
+		offload_operation(blocking_executor& executor, FUNC&& func, RESUMER&& resumer = RESUMER{})
+			: detail::blocking_operation(&offload_operation::execute, &offload_operation::resume)
+			, m_executor(executor)
+			, m_func(std::move(func))
+			, m_resumer(std::move(resumer))
+		{}
+
+		// Only valid before the operation has been awaited.
+		offload_operation(offload_operation&& other)
+			: detail::blocking_operation(&offload_operation::execute, &offload_operation::resume)
+			, m_executor(other.m_executor)
+			, m_func(std::move(other.m_func))
+			, m_resumer(std::move(other.m_resumer))
+		{}
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+		{
+			m_awaiter = awaiter;
+			m_executor.schedule(this);
+		}
+
+		decltype(auto) await_resume()
+		{
+			if (m_exception)
+			{
+				std::rethrow_exception(m_exception);
+			}
+
+			return m_result.get();
+		}
+
+	private:
+
+		static void execute(detail::blocking_operation* operation) noexcept
+		{
+			auto* self = static_cast<offload_operation*>(operation);
+			try
+			{
+				self->m_result.set(self->m_func);
+			}
+			catch (...)
+			{
+				self->m_exception = std::current_exception();
+			}
+		}
+
+		static void resume(detail::blocking_operation* operation) noexcept
+		{
+			auto* self = static_cast<offload_operation*>(operation);
+
+			// Resuming the coroutine may destroy the operation, and the
+			// resumer along with it.
+			auto awaiter = self->m_awaiter;
+			RESUMER resumer = std::move(self->m_resumer);
+			resumer(awaiter);
+		}
+
+		blocking_executor& m_executor;
+		FUNC m_func;
+		RESUMER m_resumer;
+		detail::offload_result<result_type> m_result;
+		std::exception_ptr m_exception;
+
+	};
+
+	/// \brief
+	/// Run 'func' on one of the executor's threads.
+	///
+	/// The awaiting coroutine is suspended until the call completes and is
+	/// then resumed inline on the executor thread that ran it. Everything the
+	/// coroutine does until its next suspension point therefore occupies
+	/// that thread. In particular, if it then blocks waiting for other work
+	/// offloaded to the same executor it can deadlock once all of the
+	/// executor's threads are doing so. Use the overload taking a resumer
+	/// to continue on another thread or event loop instead.
+	///
+	/// \return
+	/// An awaitable whose result is the value returned by 'func'.
+	template<typename FUNC>
+	offload_operation<std::decay_t<FUNC>> offload(blocking_executor& executor, FUNC&& func)
+	{
+		return offload_operation<std::decay_t<FUNC>>{
+			executor, std::decay_t<FUNC>(std::forward<FUNC>(func)) };
+	}
+
+	/// \brief
+	/// Run 'func' on one of the executor's threads and then pass the
+	/// awaiting coroutine to 'resumeOn' to be resumed.
+	///
+	/// \param resumeOn
+	/// A callable taking a std::experimental::coroutine_handle<>, invoked
+	/// on the executor thread once 'func' has completed. It must arrange
+	/// for the coroutine to be resumed, eg. by posting it to an event
+	/// loop, and must not throw.
+	///
+	/// \return
+	/// An awaitable whose result is the value returned by 'func'.
+	template<typename FUNC, typename RESUMER>
+	offload_operation<std::decay_t<FUNC>, std::decay_t<RESUMER>> offload(
+		blocking_executor& executor, FUNC&& func, RESUMER&& resumeOn)
+	{
+		return offload_operation<std::decay_t<FUNC>, std::decay_t<RESUMER>>{
+			executor,
+			std::decay_t<FUNC>(std::forward<FUNC>(func)),
+			std::decay_t<RESUMER>(std::forward<RESUMER>(resumeOn)) };
+	}
+}
+
+#endif
@@ -0,0 +1,592 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_CONCURRENT_HASH_MAP_HPP_INCLUDED
+#define CPPCORO_CONCURRENT_HASH_MAP_HPP_INCLUDED
+
+#include <cppcoro/epoch_reclamation.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+
+namespace cppcoro
+{
+	/// \brief
+	/// A lock-free hash map with wait-free lookups.
+	///
+	/// Each bucket holds an immutable singly-linked chain of nodes. Updates
+	/// build a new version of the chain (copying only the nodes in front of
+	/// the one being changed) and publish it with a single compare-exchange.
+	/// Replaced nodes are reclaimed with epoch_retire().
+	///
+	/// When the number of entries exceeds the number of buckets a table with
+	/// twice as many buckets is installed and entries are migrated to it
+	/// incrementally: each old bucket is frozen and split into two new
+	/// buckets, either when one of the new buckets is first written to or
+	/// by writers helping with the migration a few buckets at a time.
+	///
+	/// Lookups never wait for writers and complete in a bounded number of
+	/// steps. Writers are lock-free.
+	///
+	/// Keys and values must be copy-constructible since entries are copied
+	/// when a table is resized. No operation may be called concurrently with
+	/// the destructor.
+	template<
+		typename KEY,
+		typename VALUE,
+		typename HASH = std::hash<KEY>,
+		typename EQUAL = std::equal_to<KEY>>
+	class concurrent_hash_map
+	{
+		struct node
+		{
+			template<typename V>
+			node(std::size_t hash, const KEY& key, V&& value, node* next)
+				: m_hash(hash)
+				, m_key(key)
+				, m_value(std::forward<V>(value))
+				, m_next(next)
+			{}
+
+			const std::size_t m_hash;
+			const KEY m_key;
+			const VALUE m_value;
+
+			// Only modified before the node is published.
+			node* m_next;
+		};
+
+		// Bucket states, stored in a std::uintptr_t.
+		// - pointer to first node of chain, or 0 if empty
+		// - pointer | frozen_bit - migrated to the next table, contents are final
+		// - uninitialised - not yet migrated from the previous table
+		static constexpr std::uintptr_t frozen_bit = 1;
+		static constexpr std::uintptr_t uninitialised = 2;
+
+		// Number of old buckets migrated by each write while resizing.
+		static constexpr std::size_t migration_batch_size = 2;
+
+		struct table
+		{
+			table(std::size_t capacity, table* previous)
+				: m_capacity(capacity)
+				, m_mask(capacity - 1)
+				, m_buckets(new std::atomic<std::uintptr_t>[capacity])
+				, m_previous(previous)
+				, m_next(nullptr)
+				, m_migrationCursor(0)
+				, m_initialisedCount(0)
+			{
+				const std::uintptr_t initialState = previous != nullptr ? uninitialised : 0;
+				for (std::size_t i = 0; i < capacity; ++i)
+				{
+					m_buckets[i].store(initialState, std::memory_order_relaxed);
+				}
+			}
+
+			~table()
+			{
+				for (std::size_t i = 0; i < m_capacity; ++i)
+				{
+					const std::uintptr_t head = m_buckets[i].load(std::memory_order_relaxed);
+					if (head != uninitialised)
+					{
+						delete_chain(to_node(head));
+					}
+				}
+			}
+
+			std::atomic<std::uintptr_t>& bucket(std::size_t hash) noexcept
+			{
+				return m_buckets[hash & m_mask];
+			}
+
+			const std::size_t m_capacity;
+			const std::size_t m_mask;
+			const std::unique_ptr<std::atomic<std::uintptr_t>[]> m_buckets;
+
+			// Table being migrated into this one, or nullptr once complete.
+			std::atomic<table*> m_previous;
+
+			// Table this one is being migrated into, if any.
+			std::atomic<table*> m_next;
+
+			std::atomic<std::size_t> m_migrationCursor;
+			std::atomic<std::size_t> m_initialisedCount;
+		};
+
+	public:
+
+		explicit concurrent_hash_map(std::size_t initialCapacity = 16)
+			: m_table(new table(round_up_to_power_of_two(initialCapacity), nullptr))
+			, m_size(0)
+		{}
+
+		~concurrent_hash_map()
+		{
+			table* t = m_table.load(std::memory_order_relaxed);
+			delete t->m_previous.load(std::memory_order_relaxed);
+			delete t;
+		}
+
+		concurrent_hash_map(const concurrent_hash_map&) = delete;
+		concurrent_hash_map& operator=(const concurrent_hash_map&) = delete;
+
+		/// \brief
+		/// Look up the value associated with 'key'.
+		///
+		/// This is wait-free.
+		///
+		/// \return
+		/// true and copies the value into 'value' if the key is present,
+		/// false otherwise.
+		bool find(const KEY& key, VALUE& value) const
+		{
+			epoch_guard guard;
+			const node* n = find_node(key);
+			if (n == nullptr)
+			{
+				return false;
+			}
+
+			value = n->m_value;
+			return true;
+		}
+
+		/// Query if the map contains 'key'. This is wait-free.
+		bool contains(const KEY& key) const
+		{
+			epoch_guard guard;
+			return find_node(key) != nullptr;
+		}
+
+		/// \brief
+		/// Insert 'key' with 'value' if it is not already present.
+		///
+		/// \return
+		/// true if inserted, false if the key was already present.
+		template<typename V>
+		bool insert(const KEY& key, V&& value)
+		{
+			return update(key, std::forward<V>(value), false);
+		}
+
+		/// \brief
+		/// Insert 'key' with 'value', replacing any existing value.
+		///
+		/// \return
+		/// true if inserted, false if an existing value was replaced.
+		template<typename V>
+		bool insert_or_assign(const KEY& key, V&& value)
+		{
+			return update(key, std::forward<V>(value), true);
+		}
+
+		/// \brief
+		/// Remove 'key' from the map.
+		///
+		/// \return
+		/// true if the key was removed, false if it was not present.
+		bool erase(const KEY& key)
+		{
+			epoch_guard guard;
+
+			const std::size_t hash = m_hash(key);
+			table* t = m_table.load(std::memory_order_acquire);
+			while (true)
+			{
+				std::atomic<std::uintptr_t>& bucket = writable_bucket(t, hash);
+				std::uintptr_t head = bucket.load(std::memory_order_acquire);
+				if (!is_writable(head))
+				{
+					continue;
+				}
+
+				node* existing = find_in_chain(to_node(head), hash, key);
+				if (existing == nullptr)
+				{
+					return false;
+				}
+
+				node* newHead = copy_prefix(to_node(head), existing, existing->m_next);
+				if (bucket.compare_exchange_strong(
+					head,
+					reinterpret_cast<std::uintptr_t>(newHead),
+					std::memory_order_acq_rel,
+					std::memory_order_relaxed))
+				{
+					retire_prefix(to_node(head), existing->m_next);
+					m_size.fetch_sub(1, std::memory_order_relaxed);
+					return true;
+				}
+
+				delete_prefix(newHead, existing->m_next);
+			}
+		}
+
+		/// The number of entries in the map.
+		///
+		/// Only approximate while the map is being modified.
+		std::size_t size() const noexcept
+		{
+			return m_size.load(std::memory_order_relaxed);
+		}
+
+		/// The number of buckets in the current table.
+		std::size_t bucket_count() const noexcept
+		{
+			epoch_guard guard;
+			return m_table.load(std::memory_order_acquire)->m_capacity;
+		}
+
+	private:
+
+		static std::size_t round_up_to_power_of_two(std::size_t value) noexcept
+		{
+			std::size_t result = 1;
+			while (result < value)
+			{
+				result <<= 1;
+			}
+			return result;
+		}
+
+		static node* to_node(std::uintptr_t head) noexcept
+		{
+			return reinterpret_cast<node*>(head & ~frozen_bit);
+		}
+
+		static bool is_writable(std::uintptr_t head) noexcept
+		{
+			return head != uninitialised && (head & frozen_bit) == 0;
+		}
+
+		static void delete_chain(node* n) noexcept
+		{
+			while (n != nullptr)
+			{
+				node* next = n->m_next;
+				delete n;
+				n = next;
+			}
+		}
+
+		/// Delete the nodes of an unpublished chain up to 'end'.
+		static void delete_prefix(node* n, node* end) noexcept
+		{
+			while (n != end)
+			{
+				node* next = n->m_next;
+				delete n;
+				n = next;
+			}
+		}
+
+		/// Retire the nodes of a replaced chain up to 'end'.
+		static void retire_prefix(node* n, node* end)
+		{
+			while (n != end)
+			{
+				node* next = n->m_next;
+				epoch_retire(n);
+				n = next;
+			}
+		}
+
+		node* find_in_chain(node* n, std::size_t hash, const KEY& key) const
+		{
+			for (; n != nullptr; n = n->m_next)
+			{
+				if (n->m_hash == hash && m_equal(n->m_key, key))
+				{
+					return n;
+				}
+			}
+
+			return nullptr;
+		}
+
+		/// Copy the nodes from 'first' up to (but not including) 'last',
+		/// linking the final copy to 'tail'.
+		static node* copy_prefix(node* first, node* last, node* tail)
+		{
+			node* head = tail;
+			node** link = &head;
+			try
+			{
+				for (node* n = first; n != last; n = n->m_next)
+				{
+					node* copy = new node(n->m_hash, n->m_key, n->m_value, tail);
+					*link = copy;
+					link = &copy->m_next;
+				}
+			}
+			catch (...)
+			{
+				delete_prefix(head, tail);
+				throw;
+			}
+
+			return head;
+		}
+
+		const node* find_node(const KEY& key) const
+		{
+			const std::size_t hash = m_hash(key);
+			table* t = m_table.load(std::memory_order_acquire);
+			while (true)
+			{
+				std::uintptr_t head = t->bucket(hash).load(std::memory_order_acquire);
+				if ((head & frozen_bit) != 0)
+				{
+					// Contents moved to a newer table which may have been
+					// updated since.
+					t = t->m_next.load(std::memory_order_acquire);
+					continue;
+				}
+
+				if (head == uninitialised)
+				{
+					// Not yet migrated, so the previous table's bucket is
+					// still authoritative, whether or not it's been frozen.
+					table* previous = t->m_previous.load(std::memory_order_acquire);
+					if (previous == nullptr)
+					{
+						// Migration completed since the bucket was read.
+						continue;
+					}
+
+					head = previous->bucket(hash).load(std::memory_order_acquire);
+				}
+
+				return find_in_chain(to_node(head), hash, key);
+			}
+		}
+
+		/// Find the bucket for 'hash' that writes should be applied to,
+		/// migrating it from the previous table if needed. Updates 't'
+		/// to the table containing the bucket.
+		std::atomic<std::uintptr_t>& writable_bucket(table*& t, std::size_t hash)
+		{
+			while (true)
+			{
+				std::atomic<std::uintptr_t>& bucket = t->bucket(hash);
+				const std::uintptr_t head = bucket.load(std::memory_order_acquire);
+				if (head == uninitialised)
+				{
+					table* previous = t->m_previous.load(std::memory_order_acquire);
+					if (previous != nullptr)
+					{
+						migrate_bucket(previous, t, hash & previous->m_mask);
+					}
+				}
+				else if ((head & frozen_bit) != 0)
+				{
+					t = t->m_next.load(std::memory_order_acquire);
+				}
+				else
+				{
+					help_migrate(t);
+					return bucket;
+				}
+			}
+		}
+
+		template<typename V>
+		bool update(const KEY& key, V&& value, bool replaceExisting)
+		{
+			epoch_guard guard;
+
+			const std::size_t hash = m_hash(key);
+			std::unique_ptr<node> newNode{ new node(hash, key, std::forward<V>(value), nullptr) };
+
+			table* t = m_table.load(std::memory_order_acquire);
+			while (true)
+			{
+				std::atomic<std::uintptr_t>& bucket = writable_bucket(t, hash);
+				std::uintptr_t head = bucket.load(std::memory_order_acquire);
+				if (!is_writable(head))
+				{
+					continue;
+				}
+
+				node* existing = find_in_chain(to_node(head), hash, key);
+				if (existing != nullptr && !replaceExisting)
+				{
+					return false;
+				}
+
+				node* newHead;
+				if (existing == nullptr)
+				{
+					newNode->m_next = to_node(head);
+					newHead = newNode.get();
+				}
+				else
+				{
+					newNode->m_next = existing->m_next;
+					newHead = copy_prefix(to_node(head), existing, newNode.get());
+				}
+
+				if (bucket.compare_exchange_strong(
+					head,
+					reinterpret_cast<std::uintptr_t>(newHead),
+					std::memory_order_acq_rel,
+					std::memory_order_relaxed))
+				{
+					newNode.release();
+
+					if (existing != nullptr)
+					{
+						retire_prefix(to_node(head), existing->m_next);
+						return false;
+					}
+
+					const std::size_t newSize = m_size.fetch_add(1, std::memory_order_relaxed) + 1;
+					if (newSize > t->m_capacity)
+					{
+						try_grow(t);
+					}
+
+					return true;
+				}
+
+				if (existing != nullptr)
+				{
+					delete_prefix(newHead, newNode.get());
+				}
+			}
+		}
+
+		/// Start migrating 't' to a table with twice the capacity, unless a
+		/// migration is already in progress.
+		void try_grow(table* t)
+		{
+			if (t->m_previous.load(std::memory_order_acquire) != nullptr ||
+				t->m_next.load(std::memory_order_acquire) != nullptr)
+			{
+				return;
+			}
+
+			std::unique_ptr<table> newTable{ new table(t->m_capacity * 2, t) };
+
+			table* expected = nullptr;
+			if (t->m_next.compare_exchange_strong(
+				expected,
+				newTable.get(),
+				std::memory_order_acq_rel,
+				std::memory_order_acquire))
+			{
+				m_table.store(newTable.release(), std::memory_order_release);
+			}
+		}
+
+		/// Migrate a few buckets of the previous table, if any, so that the
+		/// migration completes even if some buckets are never written to.
+		void help_migrate(table* t)
+		{
+			table* previous = t->m_previous.load(std::memory_order_acquire);
+			if (previous == nullptr)
+			{
+				return;
+			}
+
+			for (std::size_t i = 0; i < migration_batch_size; ++i)
+			{
+				const std::size_t index = t->m_migrationCursor.fetch_add(1, std::memory_order_relaxed);
+				if (index >= previous->m_capacity)
+				{
+					return;
+				}
+
+				migrate_bucket(previous, t, index);
+			}
+		}
+
+		/// Freeze bucket 'index' of 'oldTable' and split its entries into
+		/// buckets 'index' and 'index + oldTable->m_capacity' of 'newTable'.
+		void migrate_bucket(table* oldTable, table* newTable, std::size_t index)
+		{
+			std::atomic<std::uintptr_t>& lowBucket = newTable->m_buckets[index];
+			std::atomic<std::uintptr_t>& highBucket = newTable->m_buckets[index + oldTable->m_capacity];
+			if (lowBucket.load(std::memory_order_acquire) != uninitialised &&
+				highBucket.load(std::memory_order_acquire) != uninitialised)
+			{
+				return;
+			}
+
+			std::atomic<std::uintptr_t>& oldBucket = oldTable->m_buckets[index];
+			std::uintptr_t head = oldBucket.load(std::memory_order_acquire);
+			while ((head & frozen_bit) == 0 &&
+				!oldBucket.compare_exchange_weak(
+					head,
+					head | frozen_bit,
+					std::memory_order_acq_rel,
+					std::memory_order_acquire))
+			{
+			}
+
+			node* low = nullptr;
+			node* high = nullptr;
+			try
+			{
+				for (node* n = to_node(head); n != nullptr; n = n->m_next)
+				{
+					node*& list = (n->m_hash & oldTable->m_capacity) != 0 ? high : low;
+					list = new node(n->m_hash, n->m_key, n->m_value, list);
+				}
+			}
+			catch (...)
+			{
+				delete_chain(low);
+				delete_chain(high);
+				throw;
+			}
+
+			install_bucket(oldTable, newTable, lowBucket, low);
+			install_bucket(oldTable, newTable, highBucket, high);
+		}
+
+		void install_bucket(
+			table* oldTable,
+			table* newTable,
+			std::atomic<std::uintptr_t>& bucket,
+			node* chain)
+		{
+			std::uintptr_t expected = uninitialised;
+			if (!bucket.compare_exchange_strong(
+				expected,
+				reinterpret_cast<std::uintptr_t>(chain),
+				std::memory_order_acq_rel,
+				std::memory_order_relaxed))
+			{
+				// Another thread migrated it first.
+				delete_chain(chain);
+				return;
+			}
+
+			const std::size_t initialisedCount =
+				newTable->m_initialisedCount.fetch_add(1, std::memory_order_acq_rel) + 1;
+			if (initialisedCount == newTable->m_capacity)
+			{
+				// Migration complete. Readers that already found the old table
+				// can keep using it until their epoch guard is released.
+				newTable->m_previous.store(nullptr, std::memory_order_release);
+				epoch_retire(oldTable);
+			}
+		}
+
+		std::atomic<table*> m_table;
+		std::atomic<std::size_t> m_size;
+		HASH m_hash;
+		EQUAL m_equal;
+
+	};
+}
+
+#endif
@@ -0,0 +1,141 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_EPOCH_RECLAMATION_HPP_INCLUDED
+#define CPPCORO_EPOCH_RECLAMATION_HPP_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+
+namespace cppcoro
+{
+	namespace detail
+	{
+		struct epoch_thread_record;
+	}
+
+	/// \brief
+	/// Pins the current thread to the current reclamation epoch.
+	///
+	/// While any epoch_guard is alive on a thread, objects that were
+	/// reachable when it was created will not be reclaimed, so it is safe
+	/// to dereference pointers loaded from lock-free data structures.
+	///
+	/// Guards are cheap to create and may be nested. They must be destroyed
+	/// on the thread that created them and so must NOT be held across a
+	/// co_await, since the coroutine may be resumed on another thread. A
+	/// suspended coroutine holding a guard would also stop every thread's
+	/// retired objects from being reclaimed. Use a hazard_pointer to keep a
+	/// single object alive across a suspension point.
+	class epoch_guard
+	{
+	public:
+
+		epoch_guard() noexcept;
+		~epoch_guard();
+
+		epoch_guard(const epoch_guard&) = delete;
+		epoch_guard& operator=(const epoch_guard&) = delete;
+
+	private:
+
+		detail::epoch_thread_record* m_record;
+
+	};
+
+	/// \brief
+	/// Protects a single object from reclamation without pinning an epoch.
+	///
+	/// Unlike epoch_guard, a hazard_pointer may be held across a co_await
+	/// and released on a different thread. It is more expensive to protect
+	/// an object with one (a store and a full fence per object).
+	class hazard_pointer
+	{
+	public:
+
+		/// Acquire a hazard pointer slot.
+		hazard_pointer();
+
+		/// Release the slot, unprotecting any object protected by it.
+		~hazard_pointer();
+
+		hazard_pointer(const hazard_pointer&) = delete;
+		hazard_pointer& operator=(const hazard_pointer&) = delete;
+
+		/// \brief
+		/// Load a pointer from 'source' and protect the object it points to.
+		///
+		/// \return
+		/// The loaded pointer. The object it points to will not be reclaimed
+		/// until reset() is called, another object is protected or the
+		/// hazard_pointer is destroyed.
+		template<typename T>
+		T* protect(const std::atomic<T*>& source) noexcept
+		{
+			T* value = source.load(std::memory_order_relaxed);
+			while (true)
+			{
+				m_slot->store(static_cast<void*>(value), std::memory_order_seq_cst);
+
+				// Check that the object wasn't unlinked (and possibly retired)
+				// before the hazard pointer became visible.
+				T* current = source.load(std::memory_order_seq_cst);
+				if (current == value)
+				{
+					return value;
+				}
+
+				value = current;
+			}
+		}
+
+		/// Stop protecting the current object.
+		void reset() noexcept
+		{
+			m_slot->store(nullptr, std::memory_order_release);
+		}
+
+	private:
+
+		detail::epoch_thread_record* m_record;
+		std::atomic<void*>* m_slot;
+
+	};
+
+	/// \brief
+	/// Schedule an object to be reclaimed once no thread can still hold a
+	/// reference to it.
+	///
+	/// The object must already have been unlinked from any shared data
+	/// structure so that no new references to it can be obtained.
+	///
+	/// Retired objects are queued on the calling thread and reclaimed in
+	/// batches, so the cost of checking other threads is amortised over
+	/// many calls. 'deleter' may be called on any thread.
+	void epoch_retire(void* object, void(*deleter)(void* object));
+
+	/// \brief
+	/// Schedule an object allocated with 'new' to be deleted once no thread
+	/// can still hold a reference to it.
+	template<typename T>
+	void epoch_retire(T* object)
+	{
+		epoch_retire(
+			static_cast<void*>(object),
+			[](void* p) { delete static_cast<T*>(p); });
+	}
+
+	/// \brief
+	/// Try to advance the global epoch and reclaim objects retired by the
+	/// current thread that are no longer referenced.
+	///
+	/// This is called automatically by epoch_retire() every so often.
+	///
+	/// \return
+	/// The number of objects retired by this thread still waiting to be
+	/// reclaimed.
+	std::size_t epoch_collect();
+}
+
+#endif
@@ -0,0 +1,236 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_KEYED_EXECUTOR_HPP_INCLUDED
+#define CPPCORO_KEYED_EXECUTOR_HPP_INCLUDED
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	template<typename KEY, typename HASH, typename EQUAL>
+	class keyed_executor;
+
+	/// \brief
+	/// Represents a coroutine's turn to run for a key of a keyed_executor.
+	///
+	/// The turn ends, and the next coroutine scheduled on the same key is
+	/// resumed, when this object is destroyed.
+	template<typename KEY, typename HASH = std::hash<KEY>, typename EQUAL = std::equal_to<KEY>>
+	class keyed_executor_turn
+	{
+	public:
+
+		keyed_executor_turn(keyed_executor_turn&& other) noexcept
+			: m_executor(other.m_executor)
+			, m_key(std::move(other.m_key))
+		{
+			other.m_executor = nullptr;
+		}
+
+		keyed_executor_turn(const keyed_executor_turn& other) = delete;
+		keyed_executor_turn& operator=(const keyed_executor_turn& other) = delete;
+
+		/// Ends the turn.
+		~keyed_executor_turn()
+		{
+			if (m_executor != nullptr)
+			{
+				m_executor->end_turn(m_key);
+			}
+		}
+
+		const KEY& key() const noexcept { return m_key; }
+
+	private:
+
+		friend class keyed_executor<KEY, HASH, EQUAL>;
+
+		keyed_executor_turn(keyed_executor<KEY, HASH, EQUAL>& executor, KEY&& key) noexcept
+			: m_executor(&executor)
+			, m_key(std::move(key))
+		{}
+
+		keyed_executor<KEY, HASH, EQUAL>* m_executor;
+		KEY m_key;
+
+	};
+
+	/// \brief
+	/// Serialises coroutines that share a key while letting coroutines with
+	/// different keys run in parallel.
+	///
+	/// A coroutine calls 'co_await executor.schedule(key)' to wait for its
+	/// turn on 'key'. Turns on the same key are granted strictly in the order
+	/// that the schedule() operations were awaited: ownership is handed
+	/// directly from one turn to the next so a newly scheduled coroutine can
+	/// never barge ahead of one that is already queued. Coroutines scheduled
+	/// on different keys do not wait for each other.
+	///
+	/// The queue for a key is created when the key is first scheduled and is
+	/// removed again as soon as its last turn ends, so memory use is
+	/// proportional to the number of keys with work pending.
+	///
+	/// This type does not own any threads. A coroutine whose turn is granted
+	/// synchronously continues on its current thread, otherwise it is resumed
+	/// on the thread that ended the previous turn for the key. Work for
+	/// different keys runs in parallel on whatever threads the awaiting
+	/// coroutines are running on, eg. those of a blocking_executor.
+	template<typename KEY, typename HASH = std::hash<KEY>, typename EQUAL = std::equal_to<KEY>>
+	class keyed_executor
+	{
+	public:
+
+		using turn = keyed_executor_turn<KEY, HASH, EQUAL>;
+
+		class schedule_operation
+		{
+		public:
+
+			schedule_operation(keyed_executor& executor, KEY&& key) noexcept
+				: m_executor(executor)
+				, m_key(std::move(key))
+				, m_next(nullptr)
+			{}
+
+			bool await_ready() const noexcept { return false; }
+
+			bool await_suspend(std::experimental::coroutine_handle<> awaiter)
+			{
+				m_awaiter = awaiter;
+				return m_executor.try_enqueue(this);
+			}
+
+			turn await_resume() noexcept
+			{
+				return turn{ m_executor, std::move(m_key) };
+			}
+
+		private:
+
+			friend class keyed_executor;
+
+			keyed_executor& m_executor;
+			KEY m_key;
+			schedule_operation* m_next;
+			std::experimental::coroutine_handle<> m_awaiter;
+
+		};
+
+		keyed_executor() = default;
+
+		/// Behaviour is undefined if any turns are still outstanding.
+		~keyed_executor()
+		{
+			assert(m_keys.empty());
+		}
+
+		keyed_executor(const keyed_executor&) = delete;
+		keyed_executor& operator=(const keyed_executor&) = delete;
+
+		/// \brief
+		/// Wait for a turn to run for the specified key.
+		///
+		/// \return
+		/// An operation that must be co_await'ed. The result of the co_await
+		/// expression is a keyed_executor_turn that must be kept alive for
+		/// as long as the coroutine needs to run exclusively for 'key'.
+		schedule_operation schedule(KEY key) noexcept
+		{
+			return schedule_operation{ *this, std::move(key) };
+		}
+
+		/// \brief
+		/// Query the number of keys that have a turn in progress.
+		///
+		/// This is also the number of per-key queues currently allocated.
+		std::size_t active_key_count() const
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			return m_keys.size();
+		}
+
+	private:
+
+		friend class keyed_executor_turn<KEY, HASH, EQUAL>;
+
+		// Waiters for a key that already has a turn in progress, in FIFO order.
+		struct key_queue
+		{
+			schedule_operation* m_head = nullptr;
+			schedule_operation* m_tail = nullptr;
+		};
+
+		/// \return
+		/// true if the operation was queued behind the current turn for its
+		/// key, false if it was given the turn immediately.
+		bool try_enqueue(schedule_operation* operation)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+
+			auto result = m_keys.try_emplace(operation->m_key);
+			if (result.second)
+			{
+				// No turn in progress for this key.
+				return false;
+			}
+
+			key_queue& queue = result.first->second;
+			if (queue.m_tail == nullptr)
+			{
+				queue.m_head = operation;
+			}
+			else
+			{
+				queue.m_tail->m_next = operation;
+			}
+			queue.m_tail = operation;
+
+			return true;
+		}
+
+		void end_turn(const KEY& key) noexcept
+		{
+			schedule_operation* next;
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+
+				auto it = m_keys.find(key);
+				assert(it != m_keys.end());
+
+				key_queue& queue = it->second;
+				next = queue.m_head;
+				if (next == nullptr)
+				{
+					m_keys.erase(it);
+					return;
+				}
+
+				queue.m_head = next->m_next;
+				if (queue.m_head == nullptr)
+				{
+					queue.m_tail = nullptr;
+				}
+			}
+
+			// The turn passes directly to the next waiter.
+			next->m_awaiter.resume();
+		}
+
+		mutable std::mutex m_mutex;
+
+		// Keys with a turn in progress.
+		std::unordered_map<KEY, key_queue, HASH, EQUAL> m_keys;
+
+	};
+}
+
+#endif
@@ -6,9 +6,9 @@
 #define CPPCORO_LAZY_TASK_HPP_INCLUDED
 
 #include <cppcoro/broken_promise.hpp>
+#include <cppcoro/task.hpp>
 
-#include <atomic>
-#include <exception>
+#include <cstddef>
 #include <utility>
 #include <type_traits>
 
@@ -20,182 +20,118 @@ namespace cppcoro
 
 	namespace detail
 	{
-		class lazy_task_promise_base
+		/// \brief
+		/// Allocate memory for a lazy_task coroutine frame.
+		///
+		/// Frames are allocated from a per-thread stack of memory segments.
+		/// Since a lazy_task always completes before the coroutine awaiting it
+		/// resumes, chains of lazy_tasks are normally freed in the reverse
+		/// order they were allocated and the same memory is reused by each
+		/// call, keeping it hot in the cache. Frames may also be freed out of
+		/// order or on other threads; a segment is released as soon as the
+		/// last frame allocated from it is freed. Large frames are allocated
+		/// on the heap.
+		void* lazy_task_frame_allocate(std::size_t size);
+
+		/// Free memory allocated by lazy_task_frame_allocate().
+		void lazy_task_frame_free(void* frame) noexcept;
+
+		/// \brief
+		/// Query the number of memory segments currently allocated for
+		/// lazy_task frames by all threads, including spare segments.
+		///
+		/// Intended for diagnostics and tests.
+		std::size_t lazy_task_frame_segment_count() noexcept;
+
+		/// \brief
+		/// The promise type of a lazy_task<T>.
+		///
+		/// Derives from task_promise<T> and so has the same result storage
+		/// and completion state as a task<T>. This allows start() to hand the
+		/// coroutine frame over to a task<T>, which accesses the promise through
+		/// its task_promise<T> base, instead of wrapping it in another coroutine.
+		///
+		/// While it is awaited as a lazy_task the awaiting coroutine is
+		/// resumed unconditionally from final_suspend(), as it is known to
+		/// already be suspended. When it has been started with start() it
+		/// uses the atomic completion protocol of task_promise_base.
+		template<typename T>
+		class lazy_task_promise : public task_promise<T>
 		{
 		public:
 
-			lazy_task_promise_base() noexcept
+			lazy_task_promise() noexcept
 				: m_awaiter(nullptr)
 			{}
 
-			auto initial_suspend() noexcept
-			{
-				return std::experimental::suspend_always{};
-			}
-
-			auto final_suspend() noexcept
-			{
-				struct awaitable
-				{
-					std::experimental::coroutine_handle<> m_awaiter;
-
-					awaitable(std::experimental::coroutine_handle<> awaiter) noexcept
-						: m_awaiter(awaiter)
-					{}
-
-					bool await_ready() const noexcept { return false; }
-
-					void await_suspend(std::experimental::coroutine_handle<> coroutine)
-					{
-						m_awaiter.resume();
-					}
-
-					void await_resume() noexcept {}
-				};
-
-				return awaitable{ m_awaiter };
-			}
-
-			void unhandled_exception() noexcept
+			static void* operator new(std::size_t size)
 			{
-				set_exception(std::current_exception());
+				return lazy_task_frame_allocate(size);
 			}
 
-			void set_exception(std::exception_ptr exception)
+			static void operator delete(void* frame) noexcept
 			{
-				m_exception = std::move(exception);
+				lazy_task_frame_free(frame);
 			}
 
-			bool is_ready() const noexcept
-			{
-				return static_cast<bool>(m_awaiter);
-			}
-
-			void set_awaiter(std::experimental::coroutine_handle<> awaiter)
+			auto get_return_object() noexcept
 			{
-				m_awaiter = awaiter;
+				return std::experimental::coroutine_handle<lazy_task_promise>::from_promise(*this);
 			}
 
-		protected:
-
-			bool completed_with_unhandled_exception()
+			auto initial_suspend() noexcept
 			{
-				return m_exception != nullptr;
+				return std::experimental::suspend_always{};
 			}
 
-			void rethrow_if_unhandled_exception()
+			auto final_suspend() noexcept
 			{
-				if (m_exception != nullptr)
+				struct awaitable
 				{
-					std::rethrow_exception(m_exception);
-				}
-			}
+					lazy_task_promise& m_promise;
 
-		private:
+					awaitable(lazy_task_promise& promise) noexcept
+						: m_promise(promise)
+					{}
 
-			std::experimental::coroutine_handle<> m_awaiter;
-			std::exception_ptr m_exception;
+					bool await_ready() const noexcept
+					{
+						return false;
+					}
 
-		};
+					bool await_suspend(std::experimental::coroutine_handle<>) noexcept
+					{
+						if (m_promise.m_awaiter)
+						{
+							m_promise.m_awaiter.resume();
+							return true;
+						}
 
-		template<typename T>
-		class lazy_task_promise : public lazy_task_promise_base
-		{
-		public:
+						return m_promise.set_ready_and_resume_waiters();
+					}
 
-			lazy_task_promise() noexcept = default;
+					void await_resume() noexcept {}
+				};
 
-			~lazy_task_promise()
-			{
-				if (is_ready() && !completed_with_unhandled_exception())
+				if (m_awaiter)
 				{
-					reinterpret_cast<T*>(&m_valueStorage)->~T();
+					// Awaited as a lazy_task, there can be no other waiters. The
+					// result can be published before suspending as the frame is
+					// only destroyed by the awaiter, which is still suspended.
+					this->set_ready();
 				}
-			}
 
-			auto get_return_object() noexcept
-			{
-				return std::experimental::coroutine_handle<lazy_task_promise>::from_promise(*this);
-			}
-
-			template<
-				typename VALUE,
-				typename = std::enable_if_t<std::is_convertible_v<VALUE&&, T>>>
-			void return_value(VALUE&& value)
-				noexcept(std::is_nothrow_constructible_v<T, VALUE&&>)
-			{
-				new (&m_valueStorage) T(std::forward<VALUE>(value));
-			}
-
-			T& result() &
-			{
-				rethrow_if_unhandled_exception();
-				return *reinterpret_cast<T*>(&m_valueStorage);
-			}
-
-			T&& result() &&
-			{
-				rethrow_if_unhandled_exception();
-				return std::move(*reinterpret_cast<T*>(&m_valueStorage));
+				return awaitable{ *this };
 			}
 
-		private:
-
-			// Not using std::aligned_storage here due to bug in MSVC 2015 Update 2
-			// that means it doesn't work for types with alignof(T) > 8.
-			// See MS-Connect bug #2658635.
-			alignas(T) char m_valueStorage[sizeof(T)];
-
-		};
-
-		template<>
-		class lazy_task_promise<void> : public lazy_task_promise_base
-		{
-		public:
-
-			lazy_task_promise() noexcept = default;
-
-			auto get_return_object() noexcept
-			{
-				return std::experimental::coroutine_handle<lazy_task_promise>::from_promise(*this);
-			}
-
-			void return_void() noexcept
-			{}
-
-			void result()
-			{
-				rethrow_if_unhandled_exception();
-			}
-
-		};
-
-		template<typename T>
-		class lazy_task_promise<T&> : public lazy_task_promise_base
-		{
-		public:
-
-			lazy_task_promise() noexcept = default;
-
-			auto get_return_object() noexcept
-			{
-				return std::experimental::coroutine_handle<lazy_task_promise>::from_promise(*this);
-			}
-
-			void return_value(T& value) noexcept
-			{
-				m_value = std::addressof(value);
-			}
-
-			T& result()
+			void set_awaiter(std::experimental::coroutine_handle<> awaiter)
 			{
-				rethrow_if_unhandled_exception();
-				return *m_value;
+				m_awaiter = awaiter;
 			}
 
 		private:
 
-			T* m_value;
+			std::experimental::coroutine_handle<> m_awaiter;
 
 		};
 	}
@@ -212,8 +148,10 @@ namespace cppcoro
 	/// Comparison with task<T>
 	/// -----------------------
 	/// The lazy task has lower overhead than cppcoro::task<T> as it does not
-	/// require the use of atomic operations to synchronise potential races
-	/// between the awaiting coroutine suspending and the coroutine completing.
+	/// require atomic read-modify-write operations to synchronise potential
+	/// races between the awaiting coroutine suspending and the coroutine
+	/// completing. Completion is published with a single release-store so
+	/// that is_ready() can be queried, but the awaiter is resumed directly.
 	///
 	/// The awaiting coroutine is suspended prior to the lazy_task being started
 	/// which means that when the lazy_task completes it can unconditionally
@@ -227,6 +165,9 @@ namespace cppcoro
 	///
 	/// The task<T> type does not have this issue as the awaiting coroutine is
 	/// not suspended in the case that the task completes synchronously.
+	///
+	/// A lazy_task can also be started early by passing it to start(), which
+	/// returns a task<T> that can be awaited later to collect the result.
 	template<typename T = void>
 	class lazy_task
 	{
@@ -367,9 +308,42 @@ namespace cppcoro
 
 	private:
 
+		template<typename U>
+		friend task<U> start(lazy_task<U> t);
+
 		std::experimental::coroutine_handle<promise_type> m_coroutine;
 
 	};
+
+	/// \brief
+	/// Start executing a lazy_task now rather than when it is first awaited.
+	///
+	/// The coroutine starts executing on the current thread inside this call
+	/// and runs until it first suspends or completes.
+	///
+	/// \return
+	/// A task<T> that takes over the coroutine frame of the lazy_task and
+	/// can be awaited to retrieve the result. No additional coroutine frame
+	/// is allocated.
+	template<typename T>
+	task<T> start(lazy_task<T> t)
+	{
+		if (!t.m_coroutine)
+		{
+			return task<T>{};
+		}
+
+		auto coroutine = t.m_coroutine;
+		t.m_coroutine = nullptr;
+
+		// The task refers to the frame through a type-erased handle and to
+		// the promise through its task_promise<T> base class.
+		detail::task_promise<T>* promise = &coroutine.promise();
+
+		coroutine.resume();
+
+		return task<T>{ coroutine, promise };
+	}
 }
 
 #endif
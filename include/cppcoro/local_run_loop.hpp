@@ -0,0 +1,139 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_LOCAL_RUN_LOOP_HPP_INCLUDED
+#define CPPCORO_LOCAL_RUN_LOOP_HPP_INCLUDED
+
+#include <cppcoro/resumption_queue.hpp>
+
+#include <cstddef>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	/// \brief
+	/// Determines which resumptions a local_run_loop queues.
+	enum class local_run_loop_mode
+	{
+		/// Only coroutines that await local_run_loop::schedule() or are
+		/// passed to local_run_loop::resume() are queued.
+		schedule_only,
+
+		/// In addition, coroutines that single_consumer_event::set(),
+		/// async_mutex::unlock(), the completion of a task<T> or
+		/// shared_task<T> and the other synchronisation primitives would
+		/// have resumed inline on this thread are queued.
+		all_resumptions
+	};
+
+	/// \brief
+	/// A per-thread queue of coroutines waiting to be resumed.
+	///
+	/// single_consumer_event::set(), async_mutex::unlock(), the completion of
+	/// a task<T> and so on normally resume the waiting coroutine recursively,
+	/// inside the call. While a run loop constructed with
+	/// local_run_loop_mode::all_resumptions is active on a thread, those
+	/// resumptions are queued on it instead. The queued coroutines are
+	/// resumed one after another by run(), so the stack depth stays bounded
+	/// no matter how long the chain of resumptions is.
+	///
+	/// In the default local_run_loop_mode::schedule_only mode the primitives
+	/// resume inline as usual, and an individual coroutine opts in by
+	/// awaiting local_run_loop::schedule(). This suspends it again and
+	/// queues it on the run loop, so the call that resumed it returns
+	/// straight away.
+	///
+	/// A run loop becomes active on the calling thread when it is constructed
+	/// and stops being active when it is destroyed. Run loops may be nested but
+	/// must be destroyed in the reverse order they were created, on the thread
+	/// that created them. The innermost run loop's mode applies. Resumptions
+	/// performed on other threads are not affected.
+	///
+	/// If the queue is full then coroutines are resumed inline, and awaiting
+	/// schedule() completes without suspending, as if no run loop were active.
+	class local_run_loop
+	{
+	public:
+
+		class schedule_operation
+		{
+		public:
+
+			bool await_ready() const noexcept
+			{
+				return local_run_loop::current() == nullptr;
+			}
+
+			bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+			{
+				return local_run_loop::current()->m_queue.try_push(awaiter);
+			}
+
+			void await_resume() const noexcept {}
+
+		};
+
+		/// \brief
+		/// Construct a run loop and make it active on the current thread.
+		///
+		/// \param capacity
+		/// The maximum number of coroutines that may be queued.
+		/// Rounded up to a power of two.
+		///
+		/// \param mode
+		/// Whether resumptions performed by the synchronisation primitives
+		/// on this thread are also queued while the run loop is active.
+		explicit local_run_loop(
+			std::size_t capacity = 256,
+			local_run_loop_mode mode = local_run_loop_mode::schedule_only);
+
+		/// Resumes any coroutines still queued and then deactivates the run loop.
+		~local_run_loop();
+
+		local_run_loop(const local_run_loop&) = delete;
+		local_run_loop& operator=(const local_run_loop&) = delete;
+
+		/// The run loop active on the current thread, or nullptr if none.
+		static local_run_loop* current() noexcept;
+
+		/// \brief
+		/// Reschedule the awaiting coroutine onto the current thread's run loop.
+		///
+		/// \return
+		/// An operation that must be co_await'ed. The awaiting coroutine is
+		/// resumed by the next call to run(), or immediately if there is no
+		/// run loop active on this thread.
+		static schedule_operation schedule() noexcept { return {}; }
+
+		/// \brief
+		/// Resume a coroutine, or queue it on the current thread's run loop
+		/// if one is active.
+		///
+		/// Lets custom awaitables and callbacks opt in to the run loop.
+		static void resume(std::experimental::coroutine_handle<> coroutine) noexcept;
+
+		/// \brief
+		/// Resume queued coroutines until the queue is empty.
+		///
+		/// Coroutines queued by the resumed coroutines are also resumed
+		/// before this returns. Calling run() from within a coroutine being
+		/// resumed by run() returns immediately; the outer call continues
+		/// draining the queue.
+		void run() noexcept;
+
+		/// Query if there are no queued coroutines.
+		bool empty() const noexcept { return m_queue.empty(); }
+
+	private:
+
+		detail::resumption_queue m_queue;
+		bool m_isRunning;
+		local_run_loop* m_previous;
+		detail::resumption_queue* m_previousResumptionQueue;
+
+	};
+}
+
+#endif
@@ -0,0 +1,257 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_REDUCER_HPP_INCLUDED
+#define CPPCORO_REDUCER_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cppcoro
+{
+	/// Combines values by adding them.
+	template<typename T>
+	struct sum_monoid
+	{
+		using value_type = T;
+		value_type identity() const { return T{}; }
+		void reduce(value_type& left, value_type&& right) const { left += right; }
+	};
+
+	/// Combines values by keeping the smallest.
+	template<typename T>
+	struct min_monoid
+	{
+		using value_type = T;
+		value_type identity() const { return (std::numeric_limits<T>::max)(); }
+		void reduce(value_type& left, value_type&& right) const { left = (std::min)(left, right); }
+	};
+
+	/// Combines values by keeping the largest.
+	template<typename T>
+	struct max_monoid
+	{
+		using value_type = T;
+		value_type identity() const { return std::numeric_limits<T>::lowest(); }
+		void reduce(value_type& left, value_type&& right) const { left = (std::max)(left, right); }
+	};
+
+	/// \brief
+	/// Combines vectors by appending them.
+	///
+	/// The order in which the views of different threads are appended is
+	/// unspecified.
+	template<typename T>
+	struct append_monoid
+	{
+		using value_type = std::vector<T>;
+		value_type identity() const { return value_type{}; }
+		void reduce(value_type& left, value_type&& right) const
+		{
+			if (left.empty())
+			{
+				left = std::move(right);
+			}
+			else
+			{
+				left.insert(
+					left.end(),
+					std::make_move_iterator(right.begin()),
+					std::make_move_iterator(right.end()));
+			}
+		}
+	};
+
+	/// Combines histograms by adding the counts for each key.
+	template<typename KEY>
+	struct histogram_monoid
+	{
+		using value_type = std::unordered_map<KEY, std::uint64_t>;
+		value_type identity() const { return value_type{}; }
+		void reduce(value_type& left, value_type&& right) const
+		{
+			for (auto& entry : right)
+			{
+				left[entry.first] += entry.second;
+			}
+		}
+	};
+
+	namespace detail
+	{
+		/// Allocate an id that is never reused, to identify a reducer in
+		/// the per-thread cache of views.
+		std::uint64_t reducer_allocate_id() noexcept;
+
+		struct reducer_view_cache_entry
+		{
+			std::uint64_t m_reducerId;
+			void* m_view;
+		};
+
+		constexpr std::size_t reducer_view_cache_size = 8;
+
+		/// The calling thread's cache of recently used reducer views.
+		reducer_view_cache_entry* reducer_view_cache() noexcept;
+	}
+
+	/// \brief
+	/// An accumulator that many threads can update without writing to
+	/// shared memory.
+	///
+	/// Each thread that calls view() gets its own copy of the value, starting
+	/// at the monoid's identity. The views are only combined, using the
+	/// monoid's reduce(), when get() is called. This lets the body of a
+	/// parallel loop accumulate a sum, minimum, histogram, etc. without any
+	/// contention.
+	///
+	/// Since a coroutine may be resumed on a different thread after a
+	/// co_await, it must not hold on to the reference returned by view()
+	/// across a suspension point; call view() again instead.
+	///
+	/// The monoid's reduce() should be commutative and associative, as the
+	/// order in which views are combined is unspecified.
+	///
+	/// get() and take() must only be called once all updates have completed
+	/// and been synchronised with the calling thread (ie. at the join point).
+	template<typename MONOID>
+	class reducer
+	{
+	public:
+
+		using value_type = typename MONOID::value_type;
+
+		explicit reducer(MONOID monoid = MONOID{})
+			: m_monoid(std::move(monoid))
+			, m_id(detail::reducer_allocate_id())
+			, m_views(nullptr)
+		{}
+
+		~reducer()
+		{
+			view_node* node = m_views.load(std::memory_order_relaxed);
+			while (node != nullptr)
+			{
+				view_node* next = node->m_next;
+				delete node;
+				node = next;
+			}
+		}
+
+		reducer(const reducer&) = delete;
+		reducer& operator=(const reducer&) = delete;
+
+		/// \brief
+		/// Obtain the calling thread's view of the value.
+		///
+		/// The first call on each thread allocates the view. Subsequent
+		/// calls are usually satisfied from a small per-thread cache.
+		value_type& view()
+		{
+			auto& cacheEntry =
+				detail::reducer_view_cache()[m_id % detail::reducer_view_cache_size];
+			if (cacheEntry.m_reducerId == m_id)
+			{
+				return static_cast<view_node*>(cacheEntry.m_view)->m_value;
+			}
+
+			view_node* node = find_or_create_view();
+			cacheEntry.m_reducerId = m_id;
+			cacheEntry.m_view = node;
+			return node->m_value;
+		}
+
+		/// Combine the views of all threads.
+		value_type get() const
+		{
+			value_type result = m_monoid.identity();
+			for (view_node* node = m_views.load(std::memory_order_acquire);
+				node != nullptr;
+				node = node->m_next)
+			{
+				m_monoid.reduce(result, value_type(node->m_value));
+			}
+
+			return result;
+		}
+
+		/// \brief
+		/// Combine the views of all threads by moving them into the result,
+		/// avoiding the copy of each view made by get().
+		///
+		/// Each view is reset to the monoid's identity, so the reducer can
+		/// be used to accumulate a new value afterwards.
+		value_type take()
+		{
+			value_type result = m_monoid.identity();
+			for (view_node* node = m_views.load(std::memory_order_acquire);
+				node != nullptr;
+				node = node->m_next)
+			{
+				m_monoid.reduce(result, std::move(node->m_value));
+				node->m_value = m_monoid.identity();
+			}
+
+			return result;
+		}
+
+	private:
+
+		// Each view has its own cache line so that threads don't contend.
+		struct alignas(64) view_node
+		{
+			view_node(std::thread::id thread, value_type&& value)
+				: m_thread(thread)
+				, m_value(std::move(value))
+				, m_next(nullptr)
+			{}
+
+			const std::thread::id m_thread;
+			value_type m_value;
+			view_node* m_next;
+		};
+
+		view_node* find_or_create_view()
+		{
+			const auto thisThread = std::this_thread::get_id();
+
+			view_node* head = m_views.load(std::memory_order_acquire);
+			for (view_node* node = head; node != nullptr; node = node->m_next)
+			{
+				if (node->m_thread == thisThread)
+				{
+					return node;
+				}
+			}
+
+			// Only this thread can add a view for this thread, so there's
+			// no need to search again if the push below has to retry.
+			auto* newNode = new view_node(thisThread, m_monoid.identity());
+			newNode->m_next = head;
+			while (!m_views.compare_exchange_weak(
+				newNode->m_next,
+				newNode,
+				std::memory_order_release,
+				std::memory_order_acquire))
+			{
+			}
+
+			return newNode;
+		}
+
+		MONOID m_monoid;
+		const std::uint64_t m_id;
+		std::atomic<view_node*> m_views;
+
+	};
+}
+
+#endif
@@ -0,0 +1,101 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_RESUMPTION_QUEUE_HPP_INCLUDED
+#define CPPCORO_RESUMPTION_QUEUE_HPP_INCLUDED
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	namespace detail
+	{
+		/// \brief
+		/// A fixed-capacity FIFO queue of coroutines to be resumed by a
+		/// single thread.
+		class resumption_queue
+		{
+		public:
+
+			/// The capacity is rounded up to a power of two.
+			explicit resumption_queue(std::size_t capacity)
+				: m_mask(round_up_to_power_of_two(capacity) - 1)
+				, m_queue(new std::experimental::coroutine_handle<>[m_mask + 1])
+				, m_head(0)
+				, m_tail(0)
+			{}
+
+			bool empty() const noexcept { return m_head == m_tail; }
+
+			/// \return
+			/// false if the queue is full.
+			bool try_push(std::experimental::coroutine_handle<> coroutine) noexcept
+			{
+				if (m_tail - m_head > m_mask)
+				{
+					return false;
+				}
+
+				m_queue[m_tail & m_mask] = coroutine;
+				++m_tail;
+				return true;
+			}
+
+			/// Remove the coroutine at the front of a non-empty queue.
+			std::experimental::coroutine_handle<> pop() noexcept
+			{
+				assert(!empty());
+				return m_queue[m_head++ & m_mask];
+			}
+
+		private:
+
+			static std::size_t round_up_to_power_of_two(std::size_t value) noexcept
+			{
+				std::size_t result = 1;
+				while (result < value)
+				{
+					result <<= 1;
+				}
+				return result;
+			}
+
+			std::size_t m_mask;
+			std::unique_ptr<std::experimental::coroutine_handle<>[]> m_queue;
+			std::size_t m_head;
+			std::size_t m_tail;
+
+		};
+
+		/// \brief
+		/// The queue that resumptions on the current thread are redirected
+		/// to, or nullptr if they are performed inline.
+		///
+		/// Set while a local_run_loop constructed with
+		/// local_run_loop_mode::all_resumptions is active on the thread.
+		inline thread_local resumption_queue* t_currentResumptionQueue = nullptr;
+
+		/// \brief
+		/// Resume a coroutine whose awaited operation has completed.
+		///
+		/// Used by the synchronisation primitives in place of resuming the
+		/// coroutine directly. If a local_run_loop on the current thread is
+		/// capturing resumptions then the coroutine is queued on it instead,
+		/// unless its queue is full.
+		inline void resume_or_queue(std::experimental::coroutine_handle<> coroutine) noexcept
+		{
+			resumption_queue* queue = t_currentResumptionQueue;
+			if (queue == nullptr || !queue->try_push(coroutine))
+			{
+				coroutine.resume();
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,190 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_RETRY_HPP_INCLUDED
+#define CPPCORO_RETRY_HPP_INCLUDED
+
+#include <cppcoro/lazy_task.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <utility>
+
+namespace cppcoro
+{
+	/// \brief
+	/// Limits the number of retries to a fraction of the number of calls.
+	///
+	/// A single budget is intended to be shared by all calls to the same
+	/// downstream service so that retries cannot amplify an overload.
+	///
+	/// Every call deposits 'retryRatio' tokens (up to 'maxTokens') and every
+	/// retry withdraws one token. A retry is only allowed if a whole token
+	/// is available. The budget starts with 'maxTokens' tokens.
+	///
+	/// All operations are lock-free and safe to call concurrently.
+	class retry_budget
+	{
+	public:
+
+		explicit retry_budget(double retryRatio = 0.1, std::uint32_t maxTokens = 10) noexcept;
+
+		retry_budget(const retry_budget&) = delete;
+		retry_budget& operator=(const retry_budget&) = delete;
+
+		/// Record that a new call is being made.
+		void record_call() noexcept;
+
+		/// \brief
+		/// Attempt to withdraw a token for a retry.
+		///
+		/// \return
+		/// true if the retry may go ahead, false if the budget is exhausted.
+		bool try_withdraw() noexcept;
+
+		/// The number of whole tokens currently available.
+		std::uint32_t available_tokens() const noexcept;
+
+	private:
+
+		// Tokens are stored in fixed-point, scaled by this value.
+		static constexpr std::int64_t token_scale = 1000;
+
+		const std::int64_t m_depositPerCall;
+		const std::int64_t m_maxBalance;
+		std::atomic<std::int64_t> m_balance;
+
+	};
+
+	/// \brief
+	/// Describes how many times, and how often, an operation is retried.
+	///
+	/// The delay before retry N (starting at 1) is chosen uniformly at
+	/// random from [0, min(maxBackoff, initialBackoff * multiplier^(N-1))].
+	/// This is exponential backoff with "full jitter", which spreads out
+	/// retries from clients that all failed at the same time.
+	class retry_policy
+	{
+	public:
+
+		explicit retry_policy(
+			std::uint32_t maxAttempts = 3,
+			std::chrono::nanoseconds initialBackoff = std::chrono::milliseconds(10),
+			std::chrono::nanoseconds maxBackoff = std::chrono::seconds(1),
+			double backoffMultiplier = 2.0,
+			retry_budget* budget = nullptr) noexcept
+			: m_maxAttempts(maxAttempts)
+			, m_initialBackoff(initialBackoff)
+			, m_maxBackoff(maxBackoff)
+			, m_backoffMultiplier(backoffMultiplier)
+			, m_budget(budget)
+		{}
+
+		/// Maximum number of attempts, including the first.
+		std::uint32_t max_attempts() const noexcept { return m_maxAttempts; }
+
+		/// The budget shared with other calls, or nullptr if unlimited.
+		retry_budget* budget() const noexcept { return m_budget; }
+
+		/// The upper bound of the delay before retry number 'retry' (from 1).
+		std::chrono::nanoseconds max_backoff(std::uint32_t retry) const noexcept;
+
+		/// Choose a jittered delay before retry number 'retry' (from 1).
+		std::chrono::nanoseconds backoff(std::uint32_t retry) const noexcept;
+
+	private:
+
+		std::uint32_t m_maxAttempts;
+		std::chrono::nanoseconds m_initialBackoff;
+		std::chrono::nanoseconds m_maxBackoff;
+		double m_backoffMultiplier;
+		retry_budget* m_budget;
+
+	};
+
+	namespace detail
+	{
+		template<typename TASK>
+		struct lazy_task_value;
+
+		template<typename T>
+		struct lazy_task_value<lazy_task<T>>
+		{
+			using type = T;
+		};
+
+		struct no_retry_delay
+		{
+			std::experimental::suspend_never operator()(std::chrono::nanoseconds) const noexcept
+			{
+				return {};
+			}
+		};
+	}
+
+	/// \brief
+	/// Call 'factory' to create and await a lazy_task<T>, calling it again
+	/// if the task completes with an exception.
+	///
+	/// Between attempts the coroutine awaits 'delay(policy.backoff(n))'. This
+	/// lets the caller wait on whichever timer or event loop it is running
+	/// on. No memory is allocated other than the coroutine frame for the
+	/// returned lazy_task and the frames created by 'factory'.
+	///
+	/// The operation stops retrying when either policy.max_attempts() have
+	/// been made or the policy's budget has no tokens left. The exception
+	/// from the last attempt is then rethrown.
+	///
+	/// \param factory
+	/// A callable that returns a new lazy_task<T> each time it is called.
+	///
+	/// \param delay
+	/// A callable taking a std::chrono::nanoseconds and returning an
+	/// awaitable that completes after (roughly) that long.
+	template<typename FACTORY, typename DELAY_FUNC>
+	auto retry(FACTORY factory, retry_policy policy, DELAY_FUNC delay)
+		-> lazy_task<typename detail::lazy_task_value<decltype(factory())>::type>
+	{
+		if (policy.budget() != nullptr)
+		{
+			policy.budget()->record_call();
+		}
+
+		for (std::uint32_t attempt = 1;; ++attempt)
+		{
+			std::exception_ptr error;
+			try
+			{
+				co_return co_await factory();
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			const bool canRetry =
+				attempt < policy.max_attempts() &&
+				(policy.budget() == nullptr || policy.budget()->try_withdraw());
+			if (!canRetry)
+			{
+				std::rethrow_exception(std::move(error));
+			}
+
+			co_await delay(policy.backoff(attempt));
+		}
+	}
+
+	/// \brief
+	/// Call 'factory' to create and await a lazy_task<T>, retrying
+	/// immediately if the task completes with an exception.
+	template<typename FACTORY>
+	auto retry(FACTORY factory, retry_policy policy)
+	{
+		return retry(std::move(factory), std::move(policy), detail::no_retry_delay{});
+	}
+}
+
+#endif
@@ -5,11 +5,25 @@
 #ifndef CPPCORO_SINGLE_CONSUMER_EVENT_HPP_INCLUDED
 #define CPPCORO_SINGLE_CONSUMER_EVENT_HPP_INCLUDED
 
+#include <cppcoro/resumption_queue.hpp>
+
 #include <atomic>
+#include <cstddef>
 #include <experimental/coroutine>
 
 namespace cppcoro
 {
+	/// \brief
+	/// A waiter on a single_consumer_event that is not itself a coroutine.
+	///
+	/// Allows a single awaiter to be registered with several events without
+	/// needing a coroutine per event (see wait_any() and wait_all()).
+	struct single_consumer_event_waiter
+	{
+		/// Called from within single_consumer_event::set().
+		void(*m_notify)(single_consumer_event_waiter* waiter) noexcept;
+	};
+
 	/// \brief
 	/// A manual-reset event that supports only a single awaiting
 	/// coroutine at a time.
@@ -34,6 +48,7 @@ namespace cppcoro
 		/// Otherwise, initialised the event to the 'not set' state.
 		single_consumer_event(bool initiallySet = false) noexcept
 			: m_state(initiallySet ? state::set : state::not_set)
+			, m_waiter(nullptr)
 		{}
 
 		/// Query if this event has been set.
@@ -46,13 +61,23 @@ namespace cppcoro
 		/// Transition this event to the 'set' state if it is not already set.
 		///
 		/// If there was a coroutine awaiting the event then it will be resumed
-		/// inside this call.
+		/// inside this call, or queued on the current thread's local_run_loop
+		/// if it is capturing resumptions.
 		void set()
 		{
 			const state oldState = m_state.exchange(state::set, std::memory_order_acq_rel);
 			if (oldState == state::not_set_consumer_waiting)
 			{
-				m_awaiter.resume();
+				if (m_waiter != nullptr)
+				{
+					auto* waiter = m_waiter;
+					m_waiter = nullptr;
+					waiter->m_notify(waiter);
+				}
+				else
+				{
+					detail::resume_or_queue(m_awaiter);
+				}
 			}
 		}
 
@@ -87,6 +112,7 @@ namespace cppcoro
 				bool await_suspend(std::experimental::coroutine_handle<> awaiter)
 				{
 					m_event.m_awaiter = awaiter;
+					m_event.m_waiter = nullptr;
 
 					state oldState = state::not_set;
 					return m_event.m_state.compare_exchange_strong(
@@ -107,6 +133,62 @@ namespace cppcoro
 			return awaiter{ *this };
 		}
 
+		/// \brief
+		/// Register a non-coroutine waiter to be notified when the event is set.
+		///
+		/// The waiter counts as the event's single consumer until it has
+		/// been notified or removed with try_remove_waiter().
+		///
+		/// \return
+		/// true if the waiter was registered, false if the event was already set.
+		bool try_add_waiter(single_consumer_event_waiter* waiter) noexcept
+		{
+			// Must be published before the state change as set() may read it
+			// as soon as the consumer is marked as waiting.
+			m_waiter = waiter;
+
+			state oldState = state::not_set;
+			if (m_state.compare_exchange_strong(
+				oldState,
+				state::not_set_consumer_waiting,
+				std::memory_order_release,
+				std::memory_order_acquire))
+			{
+				return true;
+			}
+
+			// The event is already set so set() won't read the waiter; don't
+			// leave a pointer to it behind after the caller has discarded it.
+			m_waiter = nullptr;
+			return false;
+		}
+
+		/// \brief
+		/// Unregister the waiter previously registered with try_add_waiter().
+		///
+		/// Must only be called by the owner of that waiter, and at most once.
+		///
+		/// \return
+		/// true if the waiter was removed and will not be notified, false if
+		/// the event has been set and the waiter is being (or has been) notified.
+		bool try_remove_waiter() noexcept
+		{
+			state oldState = state::not_set_consumer_waiting;
+			if (m_state.compare_exchange_strong(
+				oldState,
+				state::not_set,
+				std::memory_order_relaxed,
+				std::memory_order_relaxed))
+			{
+				// No new consumer may start waiting until this one is done,
+				// so this can't overwrite another registration.
+				m_waiter = nullptr;
+				return true;
+			}
+
+			return false;
+		}
+
 	private:
 
 		enum class state
@@ -122,6 +204,9 @@ namespace cppcoro
 		std::atomic<state> m_state;
 		std::experimental::coroutine_handle<> m_awaiter;
 
+		// If non-null then this waiter is notified instead of resuming m_awaiter.
+		single_consumer_event_waiter* m_waiter;
+
 	};
 }
 
@@ -6,8 +6,11 @@
 #define CPPCORO_TASK_HPP_INCLUDED
 
 #include <cppcoro/broken_promise.hpp>
+#include <cppcoro/resumption_queue.hpp>
 
 #include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <exception>
 #include <utility>
 #include <type_traits>
@@ -19,14 +22,48 @@ namespace cppcoro
 	template<typename T>
 	class task;
 
+	template<typename T>
+	class shared_task;
+
+	template<typename T>
+	class lazy_task;
+
 	namespace detail
 	{
+		struct task_waiter
+		{
+			std::experimental::coroutine_handle<> m_coroutine;
+			task_waiter* m_next;
+		};
+
+		/// \brief
+		/// Completion protocol shared by task<T> and shared_task<T>.
+		///
+		/// Both task types use the same promise type so that a task<T> can be
+		/// converted to a shared_task<T> by handing over its coroutine handle
+		/// (see make_shared_task()) rather than by wrapping it in another
+		/// coroutine. A task<T> simply never has more than one waiter or
+		/// more than one reference from the consumer side.
+		///
+		/// The coroutine and its consumers agree on who destroys the frame
+		/// through the single exchange made on completion: if the consumers
+		/// have all detached the coroutine destroys itself, otherwise the
+		/// last consumer destroys it once it is ready. The reference count is
+		/// only used by shared_task<T> to count its copies, so a task<T> pays
+		/// for no more atomic operations than this exchange.
+		///
+		/// The task types refer to the promise through a task_promise<T>
+		/// pointer rather than through the type of the coroutine handle, so
+		/// that the promise may also be a class derived from task_promise<T>
+		/// (see lazy_task_promise<T> and start()).
 		class task_promise_base
 		{
 		public:
 
 			task_promise_base() noexcept
-				: m_state(state::running)
+				: m_refCount(1)
+				, m_waiters(nullptr)
+				, m_exception(nullptr)
 			{}
 
 			auto initial_suspend() noexcept
@@ -46,19 +83,12 @@ namespace cppcoro
 
 					bool await_ready() const noexcept
 					{
-						return m_promise.m_state.load(std::memory_order_acquire) == state::consumer_detached;
+						return false;
 					}
 
-					// If resuming awaiter can potentially throw what state would that leave this coroutine in?
 					bool await_suspend(std::experimental::coroutine_handle<>) noexcept
 					{
-						state oldState = m_promise.m_state.exchange(state::finished, std::memory_order_acq_rel);
-						if (oldState == state::consumer_suspended)
-						{
-							m_promise.m_awaiter.resume();
-						}
-
-						return oldState != state::consumer_detached;
+						return m_promise.set_ready_and_resume_waiters();
 					}
 
 					void await_resume() noexcept
@@ -70,8 +100,8 @@ namespace cppcoro
 
 			void unhandled_exception() noexcept
 			{
-				// No point capturing exception if consumer already detached.
-				if (m_state.load(std::memory_order_relaxed) != state::consumer_detached)
+				// No point capturing exception if no more references to the task.
+				if (m_waiters.load(std::memory_order_relaxed) != detached_value())
 				{
 					m_exception = std::current_exception();
 				}
@@ -84,30 +114,127 @@ namespace cppcoro
 
 			bool is_ready() const noexcept
 			{
-				return m_state.load(std::memory_order_acquire) == state::finished;
+				return m_waiters.load(std::memory_order_acquire) == static_cast<const void*>(this);
 			}
 
+			/// Add a reference from another copy of a shared_task.
+			void add_ref() noexcept
+			{
+				m_refCount.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			/// Remove a reference held by a copy of a shared_task.
+			///
+			/// \return
+			/// true if this was the last reference, in which case the caller
+			/// must call try_detach().
+			bool release_ref() noexcept
+			{
+				return m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+			}
+
+			/// Detach the last consumer from the coroutine.
+			///
+			/// \return
+			/// true if successfully detached, in which case the coroutine will
+			/// destroy itself when it completes. false if the coroutine has
+			/// already completed, in which case the caller must call destroy()
+			/// on the coroutine handle.
 			bool try_detach() noexcept
 			{
-				return m_state.exchange(
-					state::consumer_detached,
-					std::memory_order_acq_rel) == state::running;
+				void* oldWaiters = nullptr;
+				if (m_waiters.compare_exchange_strong(
+					oldWaiters,
+					detached_value(),
+					std::memory_order_acq_rel,
+					std::memory_order_acquire))
+				{
+					return true;
+				}
+
+				// A consumer can't detach while it, or a copy of it, is awaited.
+				assert(oldWaiters == static_cast<void*>(this));
+				return false;
 			}
 
-			bool try_await(std::experimental::coroutine_handle<> awaiter)
+			/// Try to enqueue a waiter to the list of waiters.
+			///
+			/// \return
+			/// true if the waiter was successfully queued, in which case
+			/// waiter->m_coroutine will be resumed when the task completes.
+			/// false if the coroutine was already completed and the awaiting
+			/// coroutine can continue without suspending.
+			bool try_await(task_waiter* waiter)
 			{
-				m_awaiter = awaiter;
+				void* oldWaiters = m_waiters.load(std::memory_order_acquire);
+				do
+				{
+					if (oldWaiters == static_cast<void*>(this))
+					{
+						// Coroutine already completed, don't suspend.
+						return false;
+					}
 
-				state oldState = state::running;
-				return m_state.compare_exchange_strong(
-					oldState,
-					state::consumer_suspended,
+					waiter->m_next = static_cast<task_waiter*>(oldWaiters);
+				} while (!m_waiters.compare_exchange_weak(
+					oldWaiters,
+					static_cast<void*>(waiter),
 					std::memory_order_release,
-					std::memory_order_acquire);
+					std::memory_order_acquire));
+
+				return true;
 			}
 
 		protected:
 
+			/// \brief
+			/// Publish the result when it is known that there are no waiters
+			/// and that the consumer has not detached.
+			///
+			/// Unless the consumer is known to be suspended, this must only be
+			/// called once the coroutine has suspended at its final suspend
+			/// point, as the frame may be destroyed as soon as the result is
+			/// published.
+			void set_ready() noexcept
+			{
+				m_waiters.store(static_cast<void*>(this), std::memory_order_release);
+			}
+
+			/// \brief
+			/// Publish the result and resume any coroutines awaiting it.
+			///
+			/// Must only be called once the coroutine has suspended at its
+			/// final suspend point, as the frame may be destroyed as soon as
+			/// the result is published.
+			///
+			/// \return
+			/// false if the consumer had already detached, in which case the
+			/// coroutine must not remain suspended so that its frame is
+			/// destroyed.
+			bool set_ready_and_resume_waiters() noexcept
+			{
+				void* waiters = m_waiters.exchange(static_cast<void*>(this), std::memory_order_acq_rel);
+				if (waiters == detached_value())
+				{
+					return false;
+				}
+
+				if (waiters != nullptr)
+				{
+					task_waiter* next = static_cast<task_waiter*>(waiters);
+					do
+					{
+						// Read the m_next pointer before resuming the coroutine
+						// since resuming the coroutine may destroy the task_waiter value.
+						auto coroutine = next->m_coroutine;
+						next = next->m_next;
+						resume_or_queue(coroutine);
+					} while (next != nullptr);
+				}
+
+				return true;
+			}
+
 			bool completed_with_unhandled_exception()
 			{
 				return m_exception != nullptr;
@@ -123,16 +250,26 @@ namespace cppcoro
 
 		private:
 
-			enum class state
+			// The value of m_waiters once the last consumer has detached.
+			// Any address in the promise other than 'this' will do.
+			void* detached_value() noexcept
 			{
-				running,
-				consumer_suspended,
-				consumer_detached,
-				finished
-			};
+				return static_cast<void*>(&m_waiters);
+			}
+
+			// Number of shared_task<T> objects referring to the coroutine.
+			// Initialised to 1 for the task<T> or shared_task<T> returned by
+			// the coroutine. Never modified by a task<T>.
+			std::atomic<std::uint32_t> m_refCount;
+
+			// Value is either
+			// - nullptr - indicates no waiters
+			// - this - indicates value is ready
+			// - &m_waiters - indicates all consumers have detached
+			// - other - pointer to head item in linked-list of waiters.
+			//           values are of type 'cppcoro::detail::task_waiter'.
+			std::atomic<void*> m_waiters;
 
-			std::atomic<state> m_state;
-			std::experimental::coroutine_handle<> m_awaiter;
 			std::exception_ptr m_exception;
 
 		};
@@ -146,7 +283,9 @@ namespace cppcoro
 
 			~task_promise()
 			{
-				if (!completed_with_unhandled_exception())
+				// The coroutine may never have run if it is the frame of a
+				// lazy_task that was never awaited or started.
+				if (is_ready() && !completed_with_unhandled_exception())
 				{
 					reinterpret_cast<T*>(&m_valueStorage)->~T();
 				}
@@ -250,20 +389,22 @@ namespace cppcoro
 
 		struct awaitable_base
 		{
-			std::experimental::coroutine_handle<promise_type> m_coroutine;
+			promise_type* m_promise;
+			detail::task_waiter m_waiter;
 
-			awaitable_base(std::experimental::coroutine_handle<promise_type> coroutine) noexcept
-				: m_coroutine(coroutine)
+			awaitable_base(promise_type* promise) noexcept
+				: m_promise(promise)
 			{}
 
 			bool await_ready() const noexcept
 			{
-				return !m_coroutine || m_coroutine.promise().is_ready();
+				return !m_promise || m_promise->is_ready();
 			}
 
 			bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
 			{
-				return m_coroutine.promise().try_await(awaiter);
+				m_waiter.m_coroutine = awaiter;
+				return m_promise->try_await(&m_waiter);
 			}
 		};
 
@@ -271,16 +412,20 @@ namespace cppcoro
 
 		task() noexcept
 			: m_coroutine(nullptr)
+			, m_promise(nullptr)
 		{}
 
 		explicit task(std::experimental::coroutine_handle<promise_type> coroutine)
 			: m_coroutine(coroutine)
+			, m_promise(&coroutine.promise())
 		{}
 
 		task(task&& t) noexcept
 			: m_coroutine(t.m_coroutine)
+			, m_promise(t.m_promise)
 		{
 			t.m_coroutine = nullptr;
+			t.m_promise = nullptr;
 		}
 
 		/// Disable copy construction/assignment.
@@ -305,7 +450,9 @@ namespace cppcoro
 				destroy();
 
 				m_coroutine = other.m_coroutine;
+				m_promise = other.m_promise;
 				other.m_coroutine = nullptr;
+				other.m_promise = nullptr;
 			}
 
 			return *this;
@@ -317,7 +464,7 @@ namespace cppcoro
 		/// Awaiting a task that is ready will not block.
 		bool is_ready() const noexcept
 		{
-			return !m_coroutine || m_coroutine.promise().is_ready();
+			return !m_promise || m_promise->is_ready();
 		}
 
 		/// \brief
@@ -329,9 +476,11 @@ namespace cppcoro
 			if (m_coroutine)
 			{
 				auto coro = m_coroutine;
+				auto* promise = m_promise;
 				m_coroutine = nullptr;
+				m_promise = nullptr;
 
-				if (!coro.promise().try_detach())
+				if (!promise->try_detach())
 				{
 					coro.destroy();
 				}
@@ -346,16 +495,16 @@ namespace cppcoro
 
 				decltype(auto) await_resume()
 				{
-					if (!m_coroutine)
+					if (!this->m_promise)
 					{
 						throw broken_promise{};
 					}
 
-					return m_coroutine.promise().result();
+					return this->m_promise->result();
 				}
 			};
 
-			return awaitable{ m_coroutine };
+			return awaitable{ m_promise };
 		}
 
 		auto operator co_await() const && noexcept
@@ -366,16 +515,16 @@ namespace cppcoro
 
 				decltype(auto) await_resume()
 				{
-					if (!m_coroutine)
+					if (!this->m_promise)
 					{
 						throw broken_promise{};
 					}
 
-					return std::move(m_coroutine.promise()).result();
+					return std::move(*this->m_promise).result();
 				}
 			};
 
-			return awaitable{ m_coroutine };
+			return awaitable{ m_promise };
 		}
 
 		/// \brief
@@ -390,25 +539,41 @@ namespace cppcoro
 				void await_resume() const noexcept {}
 			};
 
-			return awaitable{ m_coroutine };
+			return awaitable{ m_promise };
 		}
 
 	private:
 
+		template<typename U>
+		friend shared_task<U> make_shared_task(task<U> t);
+
+		template<typename U>
+		friend task<U> start(lazy_task<U> t);
+
+		task(std::experimental::coroutine_handle<> coroutine, promise_type* promise) noexcept
+			: m_coroutine(coroutine)
+			, m_promise(promise)
+		{}
+
 		void destroy() noexcept
 		{
 			if (m_coroutine)
 			{
-				if (!m_coroutine.promise().is_ready())
+				if (!m_promise->is_ready())
 				{
 					std::terminate();
 				}
 
+				// The result is only published once the coroutine has
+				// suspended at its final suspend point.
 				m_coroutine.destroy();
 			}
 		}
 
-		std::experimental::coroutine_handle<promise_type> m_coroutine;
+		// The frame's actual promise may be derived from promise_type, so
+		// the handle is type-erased and the promise is held separately.
+		std::experimental::coroutine_handle<> m_coroutine;
+		promise_type* m_promise;
 
 	};
 }
@@ -0,0 +1,148 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_WAIT_ALL_HPP_INCLUDED
+#define CPPCORO_WAIT_ALL_HPP_INCLUDED
+
+#include <cppcoro/single_consumer_event.hpp>
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	/// \brief
+	/// An awaitable that completes once all of N single_consumer_events
+	/// have been set.
+	///
+	/// The awaiting coroutine is registered directly with every event that
+	/// is not already set; no other coroutine frames are created. It is
+	/// resumed inside the call to set() on the last of them.
+	template<std::size_t N>
+	class wait_all_operation
+	{
+	public:
+
+		static_assert(N > 0, "wait_all() requires at least one event");
+
+		explicit wait_all_operation(const std::array<single_consumer_event*, N>& events) noexcept
+			: m_events(events)
+		{
+			// Each event supports only a single waiter, so this operation
+			// can't register with the same event twice.
+			assert(distinct(events));
+		}
+
+		// Only valid before the operation has been awaited.
+		wait_all_operation(wait_all_operation&& other) noexcept
+			: m_events(other.m_events)
+		{}
+
+		bool await_ready() const noexcept
+		{
+			for (auto* event : m_events)
+			{
+				if (!event->is_set())
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+		{
+			m_awaiter = awaiter;
+
+			// One reference for each event plus one for this registration pass
+			// so the awaiter can't be resumed until registration has finished.
+			m_refCount.store(N + 1, std::memory_order_relaxed);
+
+			std::uint32_t alreadySetCount = 0;
+			for (std::size_t i = 0; i < N; ++i)
+			{
+				m_registrations[i].m_notify = &registration::on_event_set;
+				m_registrations[i].m_operation = this;
+				if (!m_events[i]->try_add_waiter(&m_registrations[i]))
+				{
+					++alreadySetCount;
+				}
+			}
+
+			return !release(alreadySetCount + 1);
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+
+		struct registration : single_consumer_event_waiter
+		{
+			static void on_event_set(single_consumer_event_waiter* waiter) noexcept
+			{
+				wait_all_operation& op = *static_cast<registration*>(waiter)->m_operation;
+				if (op.release(1))
+				{
+					detail::resume_or_queue(op.m_awaiter);
+				}
+			}
+
+			wait_all_operation* m_operation;
+		};
+
+		/// \return
+		/// true if this released the last reference.
+		bool release(std::uint32_t count) noexcept
+		{
+			return m_refCount.fetch_sub(count, std::memory_order_acq_rel) == count;
+		}
+
+		static bool distinct(const std::array<single_consumer_event*, N>& events) noexcept
+		{
+			for (std::size_t i = 0; i < N; ++i)
+			{
+				for (std::size_t j = i + 1; j < N; ++j)
+				{
+					if (events[i] == events[j])
+					{
+						return false;
+					}
+				}
+			}
+
+			return true;
+		}
+
+		std::array<single_consumer_event*, N> m_events;
+		std::array<registration, N> m_registrations;
+		std::atomic<std::uint32_t> m_refCount;
+		std::experimental::coroutine_handle<> m_awaiter;
+
+	};
+
+	/// \brief
+	/// Wait until all of the specified events are set.
+	///
+	/// \return
+	/// An awaitable that completes once every event has been set.
+	template<typename... EVENTS>
+	wait_all_operation<sizeof...(EVENTS)> wait_all(EVENTS&... events) noexcept
+	{
+		static_assert(
+			std::conjunction_v<std::is_same<EVENTS, single_consumer_event>...>,
+			"wait_all() only supports single_consumer_event");
+
+		return wait_all_operation<sizeof...(EVENTS)>{
+			std::array<single_consumer_event*, sizeof...(EVENTS)>{ &events... } };
+	}
+}
+
+#endif
@@ -0,0 +1,232 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CPPCORO_WAIT_ANY_HPP_INCLUDED
+#define CPPCORO_WAIT_ANY_HPP_INCLUDED
+
+#include <cppcoro/single_consumer_event.hpp>
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include <experimental/coroutine>
+
+namespace cppcoro
+{
+	/// \brief
+	/// An awaitable that completes when any one of N single_consumer_events
+	/// is set.
+	///
+	/// The awaiting coroutine is registered directly with every event; no
+	/// other coroutine frames are created. Once one event fires, the waiter
+	/// is removed from the other events, so they may be awaited again.
+	///
+	/// The result of the co_await expression is the index of an event that
+	/// was set. If several are set at once, the first one seen is reported.
+	template<std::size_t N>
+	class wait_any_operation
+	{
+	public:
+
+		static_assert(N > 0, "wait_any() requires at least one event");
+
+		explicit wait_any_operation(const std::array<single_consumer_event*, N>& events) noexcept
+			: m_events(events)
+		{
+			// Each event supports only a single waiter, so this operation
+			// can't register with the same event twice.
+			assert(distinct(events));
+		}
+
+		// Only valid before the operation has been awaited.
+		wait_any_operation(wait_any_operation&& other) noexcept
+			: m_events(other.m_events)
+		{}
+
+		bool await_ready() noexcept
+		{
+			for (std::size_t i = 0; i < N; ++i)
+			{
+				if (m_events[i]->is_set())
+				{
+					m_firedIndex = i;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		bool await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+		{
+			m_awaiter = awaiter;
+
+			// One reference for each event plus one for this registration pass
+			// so the awaiter can't be resumed until registration has finished.
+			m_refCount.store(N + 1, std::memory_order_relaxed);
+			m_flags.store(0, std::memory_order_relaxed);
+
+			std::size_t registeredCount = 0;
+			for (; registeredCount < N; ++registeredCount)
+			{
+				registration& r = m_registrations[registeredCount];
+				r.m_notify = &registration::on_event_set;
+				r.m_operation = this;
+				r.m_index = registeredCount;
+
+				if (!m_events[registeredCount]->try_add_waiter(&r))
+				{
+					// Event already set. No need to register with the rest.
+					on_fired(registeredCount);
+					break;
+				}
+
+				if ((m_flags.load(std::memory_order_acquire) & fired_flag) != 0)
+				{
+					++registeredCount;
+					break;
+				}
+			}
+
+			// Whoever sees both flags set unregisters from the losers.
+			const std::uint32_t oldFlags =
+				m_flags.fetch_or(registration_done_flag, std::memory_order_acq_rel);
+			if ((oldFlags & fired_flag) != 0)
+			{
+				unregister(registeredCount);
+			}
+
+			// Drop the references held by events that were never registered
+			// with and the one held by this registration pass.
+			return !release(static_cast<std::uint32_t>(N - registeredCount + 1));
+		}
+
+		std::size_t await_resume() const noexcept
+		{
+			return m_firedIndex;
+		}
+
+	private:
+
+		struct registration : single_consumer_event_waiter
+		{
+			static void on_event_set(single_consumer_event_waiter* waiter) noexcept
+			{
+				auto* r = static_cast<registration*>(waiter);
+				wait_any_operation& op = *r->m_operation;
+
+				// Only unregister if this call was the first to fire and
+				// registration has completed. Otherwise await_suspend() will.
+				if (op.on_fired(r->m_index) & registration_done_flag)
+				{
+					op.unregister(N);
+				}
+
+				if (op.release(1))
+				{
+					detail::resume_or_queue(op.m_awaiter);
+				}
+			}
+
+			wait_any_operation* m_operation;
+			std::size_t m_index;
+		};
+
+		static constexpr std::uint32_t fired_flag = 1;
+		static constexpr std::uint32_t registration_done_flag = 2;
+
+		/// Mark the operation as fired by event 'index'.
+		///
+		/// \return
+		/// registration_done_flag if this was the first event to fire and
+		/// registration had already completed, otherwise 0.
+		std::uint32_t on_fired(std::size_t index) noexcept
+		{
+			const std::uint32_t oldFlags =
+				m_flags.fetch_or(fired_flag, std::memory_order_acq_rel);
+			if ((oldFlags & fired_flag) != 0)
+			{
+				return 0;
+			}
+
+			// Published to the awaiter by the subsequent release().
+			m_firedIndex = index;
+			return oldFlags & registration_done_flag;
+		}
+
+		/// Remove the waiter from the first 'count' events, dropping the
+		/// reference held by each event it was successfully removed from.
+		void unregister(std::size_t count) noexcept
+		{
+			std::uint32_t removedCount = 0;
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				if (m_events[i]->try_remove_waiter())
+				{
+					++removedCount;
+				}
+			}
+
+			if (removedCount > 0)
+			{
+				// Can't be the last reference, the caller still holds one.
+				m_refCount.fetch_sub(removedCount, std::memory_order_acq_rel);
+			}
+		}
+
+		/// \return
+		/// true if this released the last reference.
+		bool release(std::uint32_t count) noexcept
+		{
+			return m_refCount.fetch_sub(count, std::memory_order_acq_rel) == count;
+		}
+
+		static bool distinct(const std::array<single_consumer_event*, N>& events) noexcept
+		{
+			for (std::size_t i = 0; i < N; ++i)
+			{
+				for (std::size_t j = i + 1; j < N; ++j)
+				{
+					if (events[i] == events[j])
+					{
+						return false;
+					}
+				}
+			}
+
+			return true;
+		}
+
+		std::array<single_consumer_event*, N> m_events;
+		std::array<registration, N> m_registrations;
+		std::atomic<std::uint32_t> m_refCount;
+		std::atomic<std::uint32_t> m_flags;
+		std::size_t m_firedIndex;
+		std::experimental::coroutine_handle<> m_awaiter;
+
+	};
+
+	/// \brief
+	/// Wait until any of the specified events is set.
+	///
+	/// \return
+	/// An awaitable whose co_await result is the index of the event
+	/// that was set.
+	template<typename... EVENTS>
+	wait_any_operation<sizeof...(EVENTS)> wait_any(EVENTS&... events) noexcept
+	{
+		static_assert(
+			std::conjunction_v<std::is_same<EVENTS, single_consumer_event>...>,
+			"wait_any() only supports single_consumer_event");
+
+		return wait_any_operation<sizeof...(EVENTS)>{
+			std::array<single_consumer_event*, sizeof...(EVENTS)>{ &events... } };
+	}
+}
+
+#endif
@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/async_eventcount.hpp>
+#include <cppcoro/resumption_queue.hpp>
+
+#include <cassert>
+
+cppcoro::async_eventcount::async_eventcount() noexcept
+	: m_state(0)
+	, m_head(nullptr)
+	, m_tail(nullptr)
+{}
+
+cppcoro::async_eventcount::~async_eventcount()
+{
+	assert((m_state.load(std::memory_order_relaxed) & waiter_count_mask) == 0);
+	assert(m_head == nullptr);
+}
+
+void cppcoro::async_eventcount::notify_slow(bool notifyAll) noexcept
+{
+	async_eventcount_wait_operation* waiters;
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		waiters = m_head;
+		std::uint64_t resumedCount = 0;
+		if (notifyAll)
+		{
+			for (auto* waiter = m_head; waiter != nullptr; waiter = waiter->m_next)
+			{
+				++resumedCount;
+			}
+
+			m_head = nullptr;
+			m_tail = nullptr;
+		}
+		else if (m_head != nullptr)
+		{
+			resumedCount = 1;
+			m_head = m_head->m_next;
+			if (m_head == nullptr)
+			{
+				m_tail = nullptr;
+			}
+			waiters->m_next = nullptr;
+		}
+
+		// Advancing the epoch stops waiters that have prepared but not yet
+		// suspended from suspending. Resumed waiters are no longer counted.
+		m_state.fetch_add(epoch_increment - resumedCount, std::memory_order_seq_cst);
+	}
+
+	while (waiters != nullptr)
+	{
+		// Read m_next before resuming since resuming may destroy the operation.
+		auto* waiter = waiters;
+		waiters = waiter->m_next;
+		detail::resume_or_queue(waiter->m_awaiter);
+	}
+}
+
+bool cppcoro::async_eventcount_wait_operation::await_ready() noexcept
+{
+	const std::uint64_t state = m_eventcount.m_state.load(std::memory_order_acquire);
+	if (static_cast<async_eventcount::key_type>(state >> async_eventcount::epoch_shift) != m_key)
+	{
+		m_eventcount.cancel_wait();
+		return true;
+	}
+
+	return false;
+}
+
+bool cppcoro::async_eventcount_wait_operation::await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
+{
+	m_awaiter = awaiter;
+	m_next = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock{ m_eventcount.m_mutex };
+
+		// The epoch only changes while the mutex is held so this check
+		// can't race with a notification.
+		const std::uint64_t state = m_eventcount.m_state.load(std::memory_order_relaxed);
+		if (static_cast<async_eventcount::key_type>(state >> async_eventcount::epoch_shift) == m_key)
+		{
+			if (m_eventcount.m_tail == nullptr)
+			{
+				m_eventcount.m_head = this;
+			}
+			else
+			{
+				m_eventcount.m_tail->m_next = this;
+			}
+			m_eventcount.m_tail = this;
+			return true;
+		}
+	}
+
+	// Notified since prepare_wait(), don't suspend.
+	m_eventcount.cancel_wait();
+	return false;
+}
@@ -4,6 +4,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include <cppcoro/async_mutex.hpp>
+#include <cppcoro/resumption_queue.hpp>
 
 #include <cassert>
 
@@ -77,7 +78,7 @@ void cppcoro::async_mutex::unlock()
 
 	// Resume the waiter.
 	// This will pass the ownership of the lock on to that operation/coroutine.
-	waitersHead->m_awaiter.resume();
+	detail::resume_or_queue(waitersHead->m_awaiter);
 }
 
 bool cppcoro::async_mutex_lock_operation::await_suspend(std::experimental::coroutine_handle<> awaiter) noexcept
@@ -0,0 +1,153 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/atomic_wait.hpp>
+#include <cppcoro/resumption_queue.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace
+{
+	using cppcoro::detail::parking_lot_waiter;
+
+	constexpr std::size_t bucket_count = 256;
+
+	struct alignas(64) parking_lot_bucket
+	{
+		// Number of waiters queued or about to be queued. Lets notifiers
+		// skip taking the lock when there is nobody to wake.
+		std::atomic<std::uint32_t> m_waiterCount{ 0 };
+
+		std::mutex m_mutex;
+
+		// FIFO queue of waiters, possibly on different addresses.
+		parking_lot_waiter* m_head = nullptr;
+		parking_lot_waiter* m_tail = nullptr;
+	};
+
+	parking_lot_bucket g_buckets[bucket_count];
+
+	parking_lot_bucket& bucket_for(const void* address) noexcept
+	{
+		// Low bits are mostly zero due to alignment, mix in the higher bits.
+		auto value = reinterpret_cast<std::uintptr_t>(address);
+		value ^= value >> 17;
+		value ^= value >> 9;
+		return g_buckets[(value >> 3) % bucket_count];
+	}
+
+	void notify(const void* address, bool notifyAll) noexcept
+	{
+		parking_lot_bucket& bucket = bucket_for(address);
+
+		// Orders the caller's modification of the atomic before checking
+		// for waiters. Pairs with the increment in parking_lot_park().
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (bucket.m_waiterCount.load(std::memory_order_relaxed) == 0)
+		{
+			return;
+		}
+
+		parking_lot_waiter* resumeHead = nullptr;
+		parking_lot_waiter** resumeTail = &resumeHead;
+		{
+			std::lock_guard<std::mutex> lock{ bucket.m_mutex };
+
+			std::uint32_t removedCount = 0;
+			parking_lot_waiter* previous = nullptr;
+			parking_lot_waiter* waiter = bucket.m_head;
+			while (waiter != nullptr)
+			{
+				parking_lot_waiter* next = waiter->m_next;
+				if (waiter->m_address == address)
+				{
+					if (previous == nullptr)
+					{
+						bucket.m_head = next;
+					}
+					else
+					{
+						previous->m_next = next;
+					}
+
+					if (bucket.m_tail == waiter)
+					{
+						bucket.m_tail = previous;
+					}
+
+					waiter->m_next = nullptr;
+					*resumeTail = waiter;
+					resumeTail = &waiter->m_next;
+					++removedCount;
+
+					if (!notifyAll)
+					{
+						break;
+					}
+				}
+				else
+				{
+					previous = waiter;
+				}
+
+				waiter = next;
+			}
+
+			if (removedCount != 0)
+			{
+				bucket.m_waiterCount.fetch_sub(removedCount, std::memory_order_relaxed);
+			}
+		}
+
+		while (resumeHead != nullptr)
+		{
+			// Read m_next before resuming since resuming may destroy the waiter.
+			parking_lot_waiter* waiter = resumeHead;
+			resumeHead = waiter->m_next;
+			cppcoro::detail::resume_or_queue(waiter->m_awaiter);
+		}
+	}
+}
+
+bool cppcoro::detail::parking_lot_park(parking_lot_waiter* waiter) noexcept
+{
+	parking_lot_bucket& bucket = bucket_for(waiter->m_address);
+
+	std::lock_guard<std::mutex> lock{ bucket.m_mutex };
+
+	// Announce the waiter before re-checking the value so that a notifier
+	// that changed the value either sees the count or we see its change.
+	bucket.m_waiterCount.fetch_add(1, std::memory_order_seq_cst);
+	if (!waiter->m_validate(waiter))
+	{
+		bucket.m_waiterCount.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	waiter->m_next = nullptr;
+	if (bucket.m_tail == nullptr)
+	{
+		bucket.m_head = waiter;
+	}
+	else
+	{
+		bucket.m_tail->m_next = waiter;
+	}
+	bucket.m_tail = waiter;
+
+	return true;
+}
+
+void cppcoro::atomic_notify_one(const void* address) noexcept
+{
+	notify(address, false);
+}
+
+void cppcoro::atomic_notify_all(const void* address) noexcept
+{
+	notify(address, true);
+}
@@ -0,0 +1,151 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/blocking_executor.hpp>
+
+#include <cassert>
+
+namespace
+{
+	std::int64_t nanoseconds_between(
+		std::chrono::steady_clock::time_point start,
+		std::chrono::steady_clock::time_point end) noexcept
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	}
+}
+
+cppcoro::blocking_executor::blocking_executor(std::uint32_t threadCount)
+	: m_head(nullptr)
+	, m_tail(nullptr)
+	, m_queueDepth(0)
+	, m_stopping(false)
+	, m_busyThreadCount(0)
+	, m_completedCount(0)
+	, m_totalQueueTime(0)
+	, m_totalRunTime(0)
+{
+	assert(threadCount > 0);
+
+	m_threads.reserve(threadCount);
+	try
+	{
+		for (std::uint32_t i = 0; i < threadCount; ++i)
+		{
+			m_threads.emplace_back([this] { run_worker(); });
+		}
+	}
+	catch (...)
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_stopping = true;
+		}
+		m_wakeUp.notify_all();
+
+		for (auto& thread : m_threads)
+		{
+			thread.join();
+		}
+
+		throw;
+	}
+}
+
+cppcoro::blocking_executor::~blocking_executor()
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_stopping = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (auto& thread : m_threads)
+	{
+		thread.join();
+	}
+
+	assert(m_head == nullptr);
+}
+
+cppcoro::blocking_executor::statistics cppcoro::blocking_executor::stats() const noexcept
+{
+	statistics result;
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		result.queueDepth = m_queueDepth;
+	}
+	result.busyThreadCount = m_busyThreadCount.load(std::memory_order_relaxed);
+	result.completedCount = m_completedCount.load(std::memory_order_relaxed);
+	result.totalQueueTime = std::chrono::nanoseconds{ m_totalQueueTime.load(std::memory_order_relaxed) };
+	result.totalRunTime = std::chrono::nanoseconds{ m_totalRunTime.load(std::memory_order_relaxed) };
+	return result;
+}
+
+void cppcoro::blocking_executor::schedule(detail::blocking_operation* operation) noexcept
+{
+	operation->m_enqueueTime = std::chrono::steady_clock::now();
+	operation->m_next = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (m_tail == nullptr)
+		{
+			m_head = operation;
+		}
+		else
+		{
+			m_tail->m_next = operation;
+		}
+		m_tail = operation;
+		++m_queueDepth;
+	}
+
+	m_wakeUp.notify_one();
+}
+
+void cppcoro::blocking_executor::run_worker() noexcept
+{
+	std::unique_lock<std::mutex> lock{ m_mutex };
+	while (true)
+	{
+		m_wakeUp.wait(lock, [this] { return m_head != nullptr || m_stopping; });
+		if (m_head == nullptr)
+		{
+			// Stopping and queue drained.
+			return;
+		}
+
+		detail::blocking_operation* operation = m_head;
+		m_head = operation->m_next;
+		if (m_head == nullptr)
+		{
+			m_tail = nullptr;
+		}
+		--m_queueDepth;
+
+		lock.unlock();
+
+		m_busyThreadCount.fetch_add(1, std::memory_order_relaxed);
+
+		const auto startTime = std::chrono::steady_clock::now();
+		operation->m_execute(operation);
+		const auto endTime = std::chrono::steady_clock::now();
+
+		m_totalQueueTime.fetch_add(
+			nanoseconds_between(operation->m_enqueueTime, startTime),
+			std::memory_order_relaxed);
+		m_totalRunTime.fetch_add(
+			nanoseconds_between(startTime, endTime),
+			std::memory_order_relaxed);
+		m_completedCount.fetch_add(1, std::memory_order_relaxed);
+		m_busyThreadCount.fetch_sub(1, std::memory_order_relaxed);
+
+		// Resuming the coroutine may destroy the operation.
+		operation->m_resume(operation);
+
+		lock.lock();
+	}
+}
@@ -0,0 +1,349 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/epoch_reclamation.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+	struct retired_object
+	{
+		void* m_object;
+		void(*m_deleter)(void*);
+		std::uint64_t m_epoch;
+	};
+
+	// Number of epoch_retire() calls between attempts to reclaim.
+	constexpr std::uint32_t collect_interval = 64;
+
+	constexpr std::uint32_t hazard_slot_count = 4;
+	constexpr std::uint32_t all_hazard_slots_used = (1u << hazard_slot_count) - 1;
+}
+
+namespace cppcoro
+{
+	namespace detail
+	{
+		struct epoch_thread_record
+		{
+			epoch_thread_record() noexcept
+				: m_epoch(0)
+				, m_hazardSlotMask(0)
+				, m_inUse(true)
+				, m_next(nullptr)
+				, m_pinCount(0)
+				, m_retireCount(0)
+			{
+				for (auto& slot : m_hazardSlots)
+				{
+					slot.store(nullptr, std::memory_order_relaxed);
+				}
+			}
+
+			// (epoch << 1) | 1 while pinned, 0 otherwise.
+			std::atomic<std::uint64_t> m_epoch;
+
+			std::atomic<void*> m_hazardSlots[hazard_slot_count];
+			std::atomic<std::uint32_t> m_hazardSlotMask;
+
+			// Whether the record is owned by a thread.
+			std::atomic<bool> m_inUse;
+
+			// Immutable once the record has been added to the list.
+			epoch_thread_record* m_next;
+
+			// Only accessed by the owning thread.
+			std::uint32_t m_pinCount;
+			std::uint32_t m_retireCount;
+			std::vector<retired_object> m_retired;
+		};
+	}
+}
+
+namespace
+{
+	using cppcoro::detail::epoch_thread_record;
+
+	// Records are never freed. Records released by exiting threads are
+	// reused by new threads.
+	std::atomic<epoch_thread_record*> g_records{ nullptr };
+
+	std::atomic<std::uint64_t> g_epoch{ 0 };
+
+	// Objects retired by threads that exited before they could be reclaimed.
+	std::mutex g_orphanMutex;
+	std::vector<retired_object> g_orphans;
+	std::atomic<bool> g_hasOrphans{ false };
+
+	void push_record(epoch_thread_record* record) noexcept
+	{
+		epoch_thread_record* head = g_records.load(std::memory_order_relaxed);
+		do
+		{
+			record->m_next = head;
+		} while (!g_records.compare_exchange_weak(
+			head,
+			record,
+			std::memory_order_release,
+			std::memory_order_relaxed));
+	}
+
+	epoch_thread_record* acquire_record()
+	{
+		for (auto* record = g_records.load(std::memory_order_acquire);
+			record != nullptr;
+			record = record->m_next)
+		{
+			bool inUse = false;
+			if (!record->m_inUse.load(std::memory_order_relaxed) &&
+				record->m_inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+			{
+				return record;
+			}
+		}
+
+		auto* record = new epoch_thread_record();
+		push_record(record);
+		return record;
+	}
+
+	class thread_record_holder
+	{
+	public:
+
+		thread_record_holder()
+			: m_record(acquire_record())
+		{}
+
+		~thread_record_holder()
+		{
+			assert(m_record->m_pinCount == 0);
+
+			if (!m_record->m_retired.empty())
+			{
+				std::lock_guard<std::mutex> lock{ g_orphanMutex };
+				g_orphans.insert(g_orphans.end(), m_record->m_retired.begin(), m_record->m_retired.end());
+				g_hasOrphans.store(true, std::memory_order_relaxed);
+			}
+
+			m_record->m_retired.clear();
+			m_record->m_retired.shrink_to_fit();
+			m_record->m_retireCount = 0;
+			m_record->m_inUse.store(false, std::memory_order_release);
+		}
+
+		epoch_thread_record* m_record;
+
+	};
+
+	epoch_thread_record* current_thread_record()
+	{
+		static thread_local thread_record_holder holder;
+		return holder.m_record;
+	}
+
+	/// Advance the global epoch if every pinned thread has observed it.
+	void try_advance_epoch() noexcept
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		std::uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+		for (auto* record = g_records.load(std::memory_order_acquire);
+			record != nullptr;
+			record = record->m_next)
+		{
+			const std::uint64_t recordEpoch = record->m_epoch.load(std::memory_order_acquire);
+			if ((recordEpoch & 1) != 0 && (recordEpoch >> 1) != epoch)
+			{
+				return;
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		g_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+	}
+
+	std::size_t collect(epoch_thread_record* record)
+	{
+		if (g_hasOrphans.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock{ g_orphanMutex };
+			record->m_retired.insert(record->m_retired.end(), g_orphans.begin(), g_orphans.end());
+			g_orphans.clear();
+			g_hasOrphans.store(false, std::memory_order_relaxed);
+		}
+
+		record->m_retireCount = 0;
+		if (record->m_retired.empty())
+		{
+			return 0;
+		}
+
+		try_advance_epoch();
+
+		const std::uint64_t epoch = g_epoch.load(std::memory_order_acquire);
+
+		// An object retired in epoch E may still be referenced by threads
+		// pinned in epoch E (or E - 1, if they pinned just before the epoch
+		// advanced) but not by anything pinned in epoch E + 2 or later.
+		std::vector<retired_object> candidates;
+		candidates.swap(record->m_retired);
+
+		std::vector<void*> hazards;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		for (auto* r = g_records.load(std::memory_order_acquire); r != nullptr; r = r->m_next)
+		{
+			for (auto& slot : r->m_hazardSlots)
+			{
+				void* hazard = slot.load(std::memory_order_acquire);
+				if (hazard != nullptr)
+				{
+					hazards.push_back(hazard);
+				}
+			}
+		}
+		std::sort(hazards.begin(), hazards.end());
+
+		std::vector<retired_object> reclaimable;
+		for (auto& retired : candidates)
+		{
+			if (retired.m_epoch + 2 <= epoch &&
+				!std::binary_search(hazards.begin(), hazards.end(), retired.m_object))
+			{
+				reclaimable.push_back(retired);
+			}
+			else
+			{
+				record->m_retired.push_back(retired);
+			}
+		}
+
+		// Run deleters last as they may themselves retire objects.
+		for (auto& retired : reclaimable)
+		{
+			retired.m_deleter(retired.m_object);
+		}
+
+		return record->m_retired.size();
+	}
+}
+
+cppcoro::epoch_guard::epoch_guard() noexcept
+	: m_record(current_thread_record())
+{
+	if (m_record->m_pinCount++ == 0)
+	{
+		const std::uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+		m_record->m_epoch.store((epoch << 1) | 1, std::memory_order_relaxed);
+
+		// Make the pinned epoch visible before loading any shared pointers.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+cppcoro::epoch_guard::~epoch_guard()
+{
+	// Guards must not be held across a suspension point; destroying one
+	// on another thread indicates that the coroutine was resumed there.
+	assert(m_record == current_thread_record());
+
+	if (--m_record->m_pinCount == 0)
+	{
+		m_record->m_epoch.store(0, std::memory_order_release);
+	}
+}
+
+cppcoro::hazard_pointer::hazard_pointer()
+{
+	// Prefer a slot in this thread's record, then any other record.
+	// Slots are claimed atomically so a hazard_pointer may be released
+	// on any thread.
+	auto tryClaimSlot = [this](epoch_thread_record* record) noexcept
+	{
+		std::uint32_t mask = record->m_hazardSlotMask.load(std::memory_order_relaxed);
+		while (mask != all_hazard_slots_used)
+		{
+			std::uint32_t index = 0;
+			while ((mask & (1u << index)) != 0)
+			{
+				++index;
+			}
+
+			if (record->m_hazardSlotMask.compare_exchange_weak(
+				mask,
+				mask | (1u << index),
+				std::memory_order_acquire,
+				std::memory_order_relaxed))
+			{
+				m_record = record;
+				m_slot = &record->m_hazardSlots[index];
+				return true;
+			}
+		}
+
+		return false;
+	};
+
+	auto* ownRecord = current_thread_record();
+	if (tryClaimSlot(ownRecord))
+	{
+		return;
+	}
+
+	for (auto* record = g_records.load(std::memory_order_acquire);
+		record != nullptr;
+		record = record->m_next)
+	{
+		if (record != ownRecord && tryClaimSlot(record))
+		{
+			return;
+		}
+	}
+
+	// All slots are in use. Add a new record, unowned by any thread,
+	// that a new thread may later take over.
+	auto* record = new epoch_thread_record();
+	record->m_inUse.store(false, std::memory_order_relaxed);
+	record->m_hazardSlotMask.store(1, std::memory_order_relaxed);
+	m_record = record;
+	m_slot = &record->m_hazardSlots[0];
+	push_record(record);
+}
+
+cppcoro::hazard_pointer::~hazard_pointer()
+{
+	m_slot->store(nullptr, std::memory_order_release);
+
+	const auto index = static_cast<std::uint32_t>(m_slot - &m_record->m_hazardSlots[0]);
+	m_record->m_hazardSlotMask.fetch_and(~(1u << index), std::memory_order_release);
+}
+
+void cppcoro::epoch_retire(void* object, void(*deleter)(void* object))
+{
+	auto* record = current_thread_record();
+
+	// Order the load of the epoch after the object was unlinked, so that
+	// no thread pinned in a later epoch can have seen it.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	record->m_retired.push_back(retired_object{
+		object,
+		deleter,
+		g_epoch.load(std::memory_order_relaxed) });
+
+	if (++record->m_retireCount >= collect_interval)
+	{
+		collect(record);
+	}
+}
+
+std::size_t cppcoro::epoch_collect()
+{
+	return collect(current_thread_record());
+}
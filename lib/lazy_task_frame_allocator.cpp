@@ -0,0 +1,297 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/lazy_task.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+namespace
+{
+	// Frames are pushed onto the current memory segment of a per-thread stack.
+	//
+	// Each frame is preceded by a header linking it to the frame below it in
+	// the same segment. Freeing the top-most frame pops it along with any
+	// frames below it that have already been freed, so a chain of nested
+	// lazy_tasks keeps reusing the same memory. Freeing any other frame only
+	// marks it as freed.
+	//
+	// When the current segment is full it is retired and a new one is used.
+	// A retired segment is released as soon as its last frame is freed, so
+	// frames freed out of order, or on another thread, only keep their own
+	// segment alive rather than everything allocated after them.
+	//
+	// Each segment counts its live frames. Frames allocated and freed on the
+	// owning thread while the segment is current are counted in m_liveCount
+	// without atomic operations. Any other free decrements m_remoteCount,
+	// which the owner adds m_liveCount to when it retires the segment. The
+	// segment is released by whoever brings the total to zero.
+
+	constexpr std::size_t alignment = alignof(std::max_align_t);
+	constexpr std::size_t segment_size = 64 * 1024;
+
+	// Frames bigger than this are allocated on the heap so that one large
+	// frame can't waste most of a segment.
+	constexpr std::size_t max_stack_frame_size = segment_size / 8;
+
+	// Released segments kept per thread so that a chain that repeatedly
+	// crosses segment boundaries doesn't allocate each time.
+	constexpr std::size_t max_spare_segments = 4;
+
+	constexpr std::size_t round_up(std::size_t size) noexcept
+	{
+		return (size + alignment - 1) & ~(alignment - 1);
+	}
+
+	std::atomic<std::size_t> g_segmentCount{ 0 };
+
+	struct segment
+	{
+		// Next segment in the owning thread's list of spare segments.
+		segment* m_nextSpare;
+
+		// Only accessed by the owning thread while this is its current segment.
+		std::ptrdiff_t m_liveCount;
+
+		std::atomic<std::ptrdiff_t> m_remoteCount;
+
+		char* begin() noexcept
+		{
+			return reinterpret_cast<char*>(this) + round_up(sizeof(segment));
+		}
+
+		char* end() noexcept
+		{
+			return reinterpret_cast<char*>(this) + segment_size;
+		}
+	};
+
+	struct frame_header
+	{
+		// nullptr if the frame was allocated on the heap.
+		segment* m_segment;
+		frame_header* m_previous;
+		std::atomic<bool> m_freed;
+	};
+
+	constexpr std::size_t header_size = round_up(sizeof(frame_header));
+
+	class frame_stack;
+
+	thread_local frame_stack* t_frameStack = nullptr;
+
+	class frame_stack
+	{
+	public:
+
+		frame_stack() noexcept
+			: m_segment(nullptr)
+			, m_spareSegments(nullptr)
+			, m_spareCount(0)
+			, m_top(nullptr)
+			, m_last(nullptr)
+		{}
+
+		~frame_stack()
+		{
+			// Segments that still have live frames are released by
+			// whichever thread frees their last frame.
+			t_frameStack = nullptr;
+			retire_segment();
+
+			while (m_spareSegments != nullptr)
+			{
+				segment* next = m_spareSegments->m_nextSpare;
+				delete_segment(m_spareSegments);
+				m_spareSegments = next;
+			}
+		}
+
+		frame_header* allocate(std::size_t frameSize)
+		{
+			pop_freed_frames();
+
+			const std::size_t size = header_size + round_up(frameSize);
+			if (m_segment == nullptr || static_cast<std::size_t>(m_segment->end() - m_top) < size)
+			{
+				retire_segment();
+				push_segment();
+			}
+
+			auto* header = reinterpret_cast<frame_header*>(m_top);
+			header->m_segment = m_segment;
+			header->m_previous = m_last;
+			header->m_freed.store(false, std::memory_order_relaxed);
+			++m_segment->m_liveCount;
+
+			m_top += size;
+			m_last = header;
+			return header;
+		}
+
+		/// \return
+		/// true if the frame was freed, false if it isn't in the current
+		/// segment and must be freed with free_remote().
+		bool try_free_local(frame_header* header) noexcept
+		{
+			if (header->m_segment != m_segment)
+			{
+				return false;
+			}
+
+			header->m_freed.store(true, std::memory_order_relaxed);
+			--m_segment->m_liveCount;
+			if (header == m_last)
+			{
+				pop_freed_frames();
+			}
+
+			return true;
+		}
+
+		static void free_remote(frame_header* header) noexcept
+		{
+			// Must not touch the header once it is marked freed, as the
+			// owning thread may then reuse its memory.
+			segment* s = header->m_segment;
+			header->m_freed.store(true, std::memory_order_release);
+			if (s->m_remoteCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				// The segment was retired and this was its last frame.
+				release_segment(s);
+			}
+		}
+
+	private:
+
+		void pop_freed_frames() noexcept
+		{
+			while (m_last != nullptr && m_last->m_freed.load(std::memory_order_acquire))
+			{
+				m_top = reinterpret_cast<char*>(m_last);
+				m_last = m_last->m_previous;
+			}
+		}
+
+		void push_segment()
+		{
+			segment* newSegment = m_spareSegments;
+			if (newSegment != nullptr)
+			{
+				m_spareSegments = newSegment->m_nextSpare;
+				--m_spareCount;
+			}
+			else
+			{
+				newSegment = static_cast<segment*>(::operator new(segment_size));
+				g_segmentCount.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			newSegment->m_liveCount = 0;
+			new (&newSegment->m_remoteCount) std::atomic<std::ptrdiff_t>(0);
+			m_segment = newSegment;
+			m_top = newSegment->begin();
+			m_last = nullptr;
+		}
+
+		void retire_segment() noexcept
+		{
+			segment* s = m_segment;
+			if (s == nullptr)
+			{
+				return;
+			}
+
+			m_segment = nullptr;
+			m_top = nullptr;
+			m_last = nullptr;
+
+			// Frames freed by other threads have already been subtracted.
+			const std::ptrdiff_t liveCount = s->m_liveCount;
+			if (s->m_remoteCount.fetch_add(liveCount, std::memory_order_acq_rel) + liveCount == 0)
+			{
+				release_segment(s);
+			}
+		}
+
+		static void release_segment(segment* s) noexcept
+		{
+			frame_stack* stack = t_frameStack;
+			if (stack != nullptr && stack->m_spareCount < max_spare_segments)
+			{
+				s->m_nextSpare = stack->m_spareSegments;
+				stack->m_spareSegments = s;
+				++stack->m_spareCount;
+			}
+			else
+			{
+				delete_segment(s);
+			}
+		}
+
+		static void delete_segment(segment* s) noexcept
+		{
+			::operator delete(s);
+			g_segmentCount.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		segment* m_segment;
+		segment* m_spareSegments;
+		std::size_t m_spareCount;
+		char* m_top;
+		frame_header* m_last;
+
+	};
+
+	frame_stack& current_thread_frame_stack()
+	{
+		static thread_local frame_stack stack;
+		t_frameStack = &stack;
+		return stack;
+	}
+}
+
+void* cppcoro::detail::lazy_task_frame_allocate(std::size_t size)
+{
+	frame_header* header;
+	if (size > max_stack_frame_size)
+	{
+		header = static_cast<frame_header*>(::operator new(header_size + size));
+		header->m_segment = nullptr;
+	}
+	else
+	{
+		frame_stack* stack = t_frameStack;
+		header = stack != nullptr ?
+			stack->allocate(size) :
+			current_thread_frame_stack().allocate(size);
+	}
+
+	return reinterpret_cast<char*>(header) + header_size;
+}
+
+void cppcoro::detail::lazy_task_frame_free(void* frame) noexcept
+{
+	auto* header = reinterpret_cast<frame_header*>(static_cast<char*>(frame) - header_size);
+	if (header->m_segment == nullptr)
+	{
+		::operator delete(header);
+		return;
+	}
+
+	// A segment is only ever current for the thread that allocated it.
+	frame_stack* stack = t_frameStack;
+	if (stack == nullptr || !stack->try_free_local(header))
+	{
+		frame_stack::free_remote(header);
+	}
+}
+
+std::size_t cppcoro::detail::lazy_task_frame_segment_count() noexcept
+{
+	return g_segmentCount.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,65 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/local_run_loop.hpp>
+
+#include <cassert>
+
+namespace
+{
+	thread_local cppcoro::local_run_loop* t_currentRunLoop = nullptr;
+}
+
+cppcoro::local_run_loop::local_run_loop(std::size_t capacity, local_run_loop_mode mode)
+	: m_queue(capacity)
+	, m_isRunning(false)
+	, m_previous(t_currentRunLoop)
+	, m_previousResumptionQueue(detail::t_currentResumptionQueue)
+{
+	t_currentRunLoop = this;
+	detail::t_currentResumptionQueue =
+		mode == local_run_loop_mode::all_resumptions ? &m_queue : nullptr;
+}
+
+cppcoro::local_run_loop::~local_run_loop()
+{
+	assert(t_currentRunLoop == this);
+
+	run();
+
+	t_currentRunLoop = m_previous;
+	detail::t_currentResumptionQueue = m_previousResumptionQueue;
+}
+
+cppcoro::local_run_loop* cppcoro::local_run_loop::current() noexcept
+{
+	return t_currentRunLoop;
+}
+
+void cppcoro::local_run_loop::resume(std::experimental::coroutine_handle<> coroutine) noexcept
+{
+	local_run_loop* runLoop = t_currentRunLoop;
+	if (runLoop == nullptr || !runLoop->m_queue.try_push(coroutine))
+	{
+		coroutine.resume();
+	}
+}
+
+void cppcoro::local_run_loop::run() noexcept
+{
+	if (m_isRunning)
+	{
+		return;
+	}
+
+	m_isRunning = true;
+
+	while (!m_queue.empty())
+	{
+		m_queue.pop().resume();
+	}
+
+	m_isRunning = false;
+}
@@ -0,0 +1,23 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/reducer.hpp>
+
+namespace
+{
+	// Ids start from 1 so that a zero-initialised cache entry never matches.
+	std::atomic<std::uint64_t> g_nextReducerId{ 1 };
+}
+
+std::uint64_t cppcoro::detail::reducer_allocate_id() noexcept
+{
+	return g_nextReducerId.fetch_add(1, std::memory_order_relaxed);
+}
+
+cppcoro::detail::reducer_view_cache_entry* cppcoro::detail::reducer_view_cache() noexcept
+{
+	static thread_local reducer_view_cache_entry cache[reducer_view_cache_size] = {};
+	return cache;
+}
@@ -0,0 +1,88 @@
+///////////////////////////////////////////////////////////////////////////////
+// Copyright (c) Lewis Baker
+// Licenced under MIT license. See LICENSE.txt for details.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cppcoro/retry.hpp>
+
+#include <algorithm>
+#include <random>
+
+namespace
+{
+	std::minstd_rand& thread_random_engine()
+	{
+		static thread_local std::minstd_rand engine{ std::random_device{}() };
+		return engine;
+	}
+}
+
+cppcoro::retry_budget::retry_budget(double retryRatio, std::uint32_t maxTokens) noexcept
+	: m_depositPerCall(static_cast<std::int64_t>(retryRatio * token_scale))
+	, m_maxBalance(static_cast<std::int64_t>(maxTokens) * token_scale)
+	, m_balance(static_cast<std::int64_t>(maxTokens) * token_scale)
+{}
+
+void cppcoro::retry_budget::record_call() noexcept
+{
+	std::int64_t oldBalance = m_balance.load(std::memory_order_relaxed);
+	std::int64_t newBalance;
+	do
+	{
+		if (oldBalance >= m_maxBalance)
+		{
+			return;
+		}
+
+		newBalance = (std::min)(oldBalance + m_depositPerCall, m_maxBalance);
+	} while (!m_balance.compare_exchange_weak(
+		oldBalance,
+		newBalance,
+		std::memory_order_relaxed));
+}
+
+bool cppcoro::retry_budget::try_withdraw() noexcept
+{
+	std::int64_t oldBalance = m_balance.load(std::memory_order_relaxed);
+	do
+	{
+		if (oldBalance < token_scale)
+		{
+			return false;
+		}
+	} while (!m_balance.compare_exchange_weak(
+		oldBalance,
+		oldBalance - token_scale,
+		std::memory_order_relaxed));
+
+	return true;
+}
+
+std::uint32_t cppcoro::retry_budget::available_tokens() const noexcept
+{
+	return static_cast<std::uint32_t>(m_balance.load(std::memory_order_relaxed) / token_scale);
+}
+
+std::chrono::nanoseconds cppcoro::retry_policy::max_backoff(std::uint32_t retry) const noexcept
+{
+	double backoff = static_cast<double>(m_initialBackoff.count());
+	const double limit = static_cast<double>(m_maxBackoff.count());
+	for (std::uint32_t i = 1; i < retry && backoff < limit; ++i)
+	{
+		backoff *= m_backoffMultiplier;
+	}
+
+	return std::chrono::nanoseconds{ static_cast<std::int64_t>((std::min)(backoff, limit)) };
+}
+
+std::chrono::nanoseconds cppcoro::retry_policy::backoff(std::uint32_t retry) const noexcept
+{
+	const auto limit = max_backoff(retry).count();
+	if (limit <= 0)
+	{
+		return std::chrono::nanoseconds{ 0 };
+	}
+
+	std::uniform_int_distribution<std::int64_t> distribution{ 0, limit };
+	return std::chrono::nanoseconds{ distribution(thread_random_engine()) };
+}
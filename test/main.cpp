@@ -8,12 +8,34 @@
 
 #include <cppcoro/task.hpp>
 #include <cppcoro/lazy_task.hpp>
+#include <cppcoro/local_run_loop.hpp>
 #include <cppcoro/single_consumer_event.hpp>
+#include <cppcoro/async_eventcount.hpp>
 #include <cppcoro/async_mutex.hpp>
+#include <cppcoro/atomic_wait.hpp>
+#include <cppcoro/blocking_executor.hpp>
+#include <cppcoro/concurrent_hash_map.hpp>
+#include <cppcoro/epoch_reclamation.hpp>
+#include <cppcoro/keyed_executor.hpp>
+#include <cppcoro/reducer.hpp>
 #include <cppcoro/shared_task.hpp>
-
+#include <cppcoro/async_watch.hpp>
+#include <cppcoro/async_broadcast.hpp>
+#include <cppcoro/retry.hpp>
+#include <cppcoro/wait_any.hpp>
+#include <cppcoro/wait_all.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <cassert>
 
@@ -515,6 +537,280 @@ void testPassingParameterByValueToLazyTaskCallsMoveConstructorOnce()
 }
 
 
+void testStartLazyTaskStartsExecutionImmediately()
+{
+	bool reachedBeforeEvent = false;
+	bool reachedAfterEvent = false;
+	cppcoro::single_consumer_event event;
+	auto f = [&]() -> cppcoro::lazy_task<std::string>
+	{
+		reachedBeforeEvent = true;
+		co_await event;
+		reachedAfterEvent = true;
+		co_return "foo";
+	};
+
+	auto t = cppcoro::start(f());
+	assert(reachedBeforeEvent);
+	assert(!reachedAfterEvent);
+	assert(!t.is_ready());
+
+	auto consumer = [&]() -> cppcoro::task<>
+	{
+		assert(co_await std::move(t) == "foo");
+	}();
+
+	assert(!consumer.is_ready());
+
+	event.set();
+
+	assert(reachedAfterEvent);
+	assert(t.is_ready());
+	assert(consumer.is_ready());
+}
+
+void testStartLazyTaskDoesntMoveResult()
+{
+	counter::reset_counts();
+
+	auto f = []() -> cppcoro::lazy_task<counter>
+	{
+		co_return counter{};
+	};
+
+	{
+		auto t = cppcoro::start(f());
+		assert(t.is_ready());
+		assert(counter::move_construction_count == 1);
+		assert(counter::active_count() == 1);
+
+		auto consumer = [&]() -> cppcoro::task<>
+		{
+			auto& c = co_await t;
+			assert(c.id == 0);
+		}();
+
+		assert(consumer.is_ready());
+		assert(counter::copy_construction_count == 0);
+		assert(counter::move_construction_count == 1);
+	}
+
+	assert(counter::active_count() == 0);
+}
+
+void testStartLazyTaskRethrowsException()
+{
+	class X {};
+
+	auto f = []() -> cppcoro::lazy_task<>
+	{
+		throw X{};
+		co_return;
+	};
+
+	auto t = cppcoro::start(f());
+	assert(t.is_ready());
+
+	bool ok = false;
+	auto consumer = [&]() -> cppcoro::task<>
+	{
+		try
+		{
+			co_await t;
+		}
+		catch (X)
+		{
+			ok = true;
+		}
+	}();
+
+	assert(consumer.is_ready());
+	assert(ok);
+}
+
+void testStartLazyTaskThenShareIt()
+{
+	// The shared_task refers to the promise of the lazy_task's frame, which
+	// is a larger type than the task_promise<T> it derives from.
+	cppcoro::single_consumer_event event;
+	auto f = [&]() -> cppcoro::lazy_task<std::string>
+	{
+		co_await event;
+		co_return "foo";
+	};
+
+	auto t = cppcoro::start(f());
+	assert(!t.is_ready());
+
+	auto shared = cppcoro::make_shared_task(std::move(t));
+
+	std::string results;
+	auto consumer = [&]() -> cppcoro::task<>
+	{
+		results += co_await shared;
+	};
+
+	auto c1 = consumer();
+	auto c2 = consumer();
+	assert(results.empty());
+
+	event.set();
+
+	assert(c1.is_ready());
+	assert(c2.is_ready());
+	assert(results == "foofoo");
+}
+
+void testLazyTaskFramesFreedOutOfOrderAreNotReused()
+{
+	// Results are stored in the coroutine frames, so would be overwritten
+	// if a frame still in use were handed out again.
+	auto f = [](int value) -> cppcoro::lazy_task<std::string>
+	{
+		co_return std::string(100, static_cast<char>('a' + value));
+	};
+
+	std::vector<cppcoro::task<std::string>> tasks;
+	tasks.push_back(cppcoro::start(f(0)));
+	tasks.push_back(cppcoro::start(f(1)));
+	tasks.push_back(cppcoro::start(f(2)));
+
+	// Free a frame from the middle of the stack then allocate some more.
+	tasks.erase(tasks.begin() + 1);
+	tasks.push_back(cppcoro::start(f(3)));
+	tasks.push_back(cppcoro::start(f(4)));
+
+	std::string results;
+	auto check = [&]() -> cppcoro::task<>
+	{
+		for (auto& t : tasks)
+		{
+			results += (co_await t)[99];
+		}
+	}();
+
+	assert(check.is_ready());
+	assert(results == "acde");
+}
+
+void testLazyTaskFramesFreedOutOfOrderAreReclaimed()
+{
+	auto f = [](int value) -> cppcoro::lazy_task<std::string>
+	{
+		co_return std::string(100, static_cast<char>('a' + value % 26));
+	};
+
+	const std::size_t segmentCount = cppcoro::detail::lazy_task_frame_segment_count();
+
+	// Keep a window of started tasks alive and always free the oldest, so
+	// that no frame is ever freed from the top of the stack.
+	std::vector<cppcoro::task<std::string>> tasks;
+	for (int i = 0; i < 100000; ++i)
+	{
+		tasks.push_back(cppcoro::start(f(i)));
+		if (tasks.size() > 8)
+		{
+			tasks.erase(tasks.begin());
+		}
+	}
+
+	assert(cppcoro::detail::lazy_task_frame_segment_count() < segmentCount + 8);
+}
+
+void testLazyTaskFramesFreedOnAnotherThreadAreReclaimed()
+{
+	auto f = [](int value) -> cppcoro::lazy_task<std::string>
+	{
+		co_return std::string(100, static_cast<char>('a' + value % 26));
+	};
+
+	const std::size_t segmentCount = cppcoro::detail::lazy_task_frame_segment_count();
+
+	// Frames outliving the thread that allocated them.
+	std::vector<cppcoro::task<std::string>> tasks;
+	std::thread{ [&]
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			tasks.push_back(cppcoro::start(f(i)));
+		}
+	} }.join();
+
+	assert(cppcoro::detail::lazy_task_frame_segment_count() > segmentCount);
+	tasks.clear();
+
+	// Up to a few released segments are kept as spares.
+	assert(cppcoro::detail::lazy_task_frame_segment_count() < segmentCount + 8);
+
+	// Frames freed on another thread while this thread is still allocating.
+	std::mutex mutex;
+	bool done = false;
+	std::vector<cppcoro::task<std::string>> handoff;
+	std::thread freeingThread{ [&]
+	{
+		while (true)
+		{
+			std::vector<cppcoro::task<std::string>> batch;
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				if (handoff.empty() && done)
+				{
+					return;
+				}
+				batch.swap(handoff);
+			}
+			std::this_thread::yield();
+		}
+	} };
+
+	for (int i = 0; i < 100000; ++i)
+	{
+		auto t = cppcoro::start(f(i));
+		std::lock_guard<std::mutex> lock{ mutex };
+		handoff.push_back(std::move(t));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		done = true;
+	}
+
+	freeingThread.join();
+
+	assert(cppcoro::detail::lazy_task_frame_segment_count() < segmentCount + 8);
+}
+
+void testDeeplyNestedLazyTaskChainReusesFrames()
+{
+	std::function<cppcoro::lazy_task<int>(int)> f = [&](int depth) -> cppcoro::lazy_task<int>
+	{
+		if (depth == 0)
+		{
+			co_return 0;
+		}
+
+		co_return 1 + co_await f(depth - 1);
+	};
+
+	std::size_t segmentCount = 0;
+	auto run = [&]() -> cppcoro::task<>
+	{
+		assert(co_await f(500) == 500);
+
+		// Running the chain again reuses the same segments rather than
+		// allocating more.
+		segmentCount = cppcoro::detail::lazy_task_frame_segment_count();
+		for (int i = 0; i < 10; ++i)
+		{
+			assert(co_await f(500) == 500);
+			assert(cppcoro::detail::lazy_task_frame_segment_count() == segmentCount);
+		}
+	};
+
+	auto t = run();
+	assert(t.is_ready());
+}
+
 void testAsyncMutex()
 {
 	int value = 0;
@@ -806,30 +1102,1781 @@ void testMakeSharedTask()
 	assert(consumerTask1.is_ready());
 }
 
-int main(int argc, char** argv)
+void testMakeSharedTaskDoesntMoveOrCopyResult()
 {
-	testAwaitSynchronouslyCompletingVoidFunction();
-	testAwaitTaskReturningMoveOnlyType();
-	testAwaitTaskReturningReference();
-	testAwaitDelayedCompletionChain();
-	testAwaitTaskReturningValueMovesIntoPromiseIfPassedRValue();
-	testAwaitTaskReturningValueCopiesIntoPromiseIfPassedLValue();
-	testAwaitingBrokenPromiseThrows();
-	testAwaitRethrowsException();
-	testAwaitWhenReadyDoesntThrowException();
+	counter::reset_counts();
 
-	testLazyTaskDoesntStartUntilAwaited();
-	testAwaitingDefaultConstructedLazyTaskThrowsBrokenPromise();
-	testAwaitingLazyTaskThatCompletesAsynchronously();
-	testLazyTaskResultLifetime();
-	testLazyTaskNeverAwaitedDestroysCapturedArgs();
-	testLazyTaskReturnByReference();
+	cppcoro::single_consumer_event event;
 
-	// NOTE: Test is disabled as MSVC 2017.1 compiler is currently
-	// failing the test as it calls move-constructor twice for the
-	// captured parameter value. Need to check whether this is a
-	// bug or something that is unspecified in standard.
-	//testPassingParameterByValueToLazyTaskCallsMoveConstructorOnce();
+	auto f = [&]() -> cppcoro::task<counter>
+	{
+		co_await event;
+		co_return counter{};
+	};
+
+	{
+		auto t = f();
+		auto sharedTask = cppcoro::make_shared_task(std::move(t));
+		assert(t.is_ready());
+
+		event.set();
+
+		assert(sharedTask.is_ready());
+		assert(counter::default_construction_count == 1);
+		assert(counter::move_construction_count == 1);
+		assert(counter::active_count() == 1);
+
+		auto consumer = [](cppcoro::shared_task<counter> task) -> cppcoro::task<>
+		{
+			const counter& c = co_await task;
+			assert(c.id == 0);
+		}(sharedTask);
+
+		assert(consumer.is_ready());
+		assert(counter::copy_construction_count == 0);
+		assert(counter::move_construction_count == 1);
+	}
+
+	assert(counter::active_count() == 0);
+}
+
+void testMakeSharedTaskFromLazyTask()
+{
+	bool started = false;
+	auto f = [&]() -> cppcoro::lazy_task<int>
+	{
+		started = true;
+		co_return 123;
+	};
+
+	auto t = f();
+	assert(!started);
+
+	auto sharedTask = cppcoro::make_shared_task(std::move(t));
+	assert(started);
+	assert(sharedTask.is_ready());
+
+	auto consumer = [](cppcoro::shared_task<int> task) -> cppcoro::task<>
+	{
+		assert(co_await task == 123);
+	}(sharedTask);
+
+	assert(consumer.is_ready());
+}
+
+void testDetachedTaskDestroysFrameWhenItCompletes()
+{
+	counter::reset_counts();
+
+	cppcoro::single_consumer_event event;
+
+	auto f = [&](counter c) -> cppcoro::task<int>
+	{
+		co_await event;
+		co_return c.id;
+	};
+
+	auto t = f(counter{});
+	assert(counter::active_count() == 1);
+
+	t.detach();
+	assert(counter::active_count() == 1);
+
+	event.set();
+	assert(counter::active_count() == 0);
+}
+
+void testSharedTaskFromLazyTaskDestroysFrameAfterLastCopyAndCompletion()
+{
+	counter::reset_counts();
+
+	cppcoro::single_consumer_event event;
+
+	auto f = [&](counter c) -> cppcoro::lazy_task<int>
+	{
+		co_await event;
+		co_return c.id;
+	};
+
+	{
+		auto sharedTask = cppcoro::make_shared_task(f(counter{}));
+		auto copy = sharedTask;
+		assert(!copy.is_ready());
+	}
+
+	// All consumers gone, the coroutine now owns its frame.
+	assert(counter::active_count() == 1);
+
+	event.set();
+	assert(counter::active_count() == 0);
+}
+
+void testAsyncWatchCurrentValue()
+{
+	cppcoro::async_watch<std::string> watch{ "foo" };
+	assert(watch.version() == 1);
+
+	auto snapshot = watch.current();
+	assert(snapshot.version() == 1);
+	assert(*snapshot == "foo");
+
+	watch.publish("bar");
+	assert(watch.version() == 2);
+	assert(watch.current().value() == "bar");
+
+	// Old snapshot keeps the value it was taken from alive.
+	assert(*snapshot == "foo");
+	assert(snapshot->size() == 3);
+}
+
+void testAsyncWatchNextSkipsIntermediateValues()
+{
+	cppcoro::async_watch<int> watch{ 0 };
+
+	std::vector<int> seen;
+	bool stop = false;
+
+	auto subscriber = [&]() -> cppcoro::task<>
+	{
+		std::uint64_t lastSeen = 0;
+		while (!stop)
+		{
+			auto snapshot = co_await watch.next(lastSeen);
+			lastSeen = snapshot.version();
+			seen.push_back(*snapshot);
+		}
+	};
+
+	auto t = subscriber();
+
+	// Initial value seen synchronously.
+	assert(!t.is_ready());
+	assert(seen.size() == 1 && seen[0] == 0);
+
+	watch.publish(1);
+	assert(seen.size() == 2 && seen[1] == 1);
+
+	watch.publish(2);
+	watch.publish(3);
+	assert(seen.size() == 4);
+
+	// A subscriber that was busy only sees the latest value.
+	auto lateSubscriber = [&]() -> cppcoro::task<int>
+	{
+		auto snapshot = co_await watch.next(1);
+		co_return *snapshot;
+	};
+
+	auto late = lateSubscriber();
+	assert(late.is_ready());
+
+	stop = true;
+	watch.publish(4);
+	assert(t.is_ready());
+	assert(seen.back() == 4);
+
+	[&]() -> cppcoro::task<>
+	{
+		assert(co_await late == 3);
+	}();
+}
+
+void testAsyncWatchMultipleSubscribers()
+{
+	cppcoro::async_watch<std::string> watch{ "a" };
+
+	auto subscriber = [&](std::uint64_t version) -> cppcoro::task<std::string>
+	{
+		auto snapshot = co_await watch.next(version);
+		co_return *snapshot;
+	};
+
+	auto t1 = subscriber(1);
+	auto t2 = subscriber(1);
+	auto t3 = subscriber(1);
+
+	assert(!t1.is_ready());
+	assert(!t2.is_ready());
+	assert(!t3.is_ready());
+
+	watch.publish("b");
+
+	assert(t1.is_ready());
+	assert(t2.is_ready());
+	assert(t3.is_ready());
+
+	[&]() -> cppcoro::task<>
+	{
+		assert(co_await t1 == "b");
+		assert(co_await t2 == "b");
+		assert(co_await t3 == "b");
+	}();
+}
+
+void testAsyncWatchNextWaitsPastVersionsNotYetSeen()
+{
+	cppcoro::async_watch<int> watch{ 0 };
+	assert(watch.version() == 1);
+
+	std::uint64_t seenVersion = 0;
+	int seenValue = -1;
+	auto consume = [&]() -> cppcoro::task<>
+	{
+		// Asking for a version beyond the current one.
+		auto snapshot = co_await watch.next(3);
+		seenVersion = snapshot.version();
+		seenValue = snapshot.value();
+	};
+
+	auto consumer = consume();
+
+	watch.publish(1);
+	watch.publish(2);
+	assert(!consumer.is_ready());
+
+	watch.publish(3);
+	assert(consumer.is_ready());
+	assert(seenVersion == 4);
+	assert(seenValue == 3);
+}
+
+void testAsyncBroadcastEverySubscriberSeesEveryMessage()
+{
+	cppcoro::async_broadcast<std::string> broadcast{ 4 };
+
+	auto consume = [](
+		cppcoro::async_broadcast_subscriber<std::string> subscriber,
+		std::vector<std::string>& received) -> cppcoro::task<>
+	{
+		while (true)
+		{
+			auto message = co_await subscriber.next();
+			assert(message.skipped_count() == 0);
+			if (message.value().empty())
+			{
+				break;
+			}
+			received.push_back(std::move(message).value());
+		}
+	};
+
+	std::vector<std::string> received1;
+	std::vector<std::string> received2;
+	auto consumer1 = consume(broadcast.subscribe(), received1);
+	auto consumer2 = consume(broadcast.subscribe(), received2);
+
+	auto produce = [&]() -> cppcoro::task<>
+	{
+		co_await broadcast.publish("a");
+		co_await broadcast.publish("b");
+		co_await broadcast.publish("c");
+		co_await broadcast.publish("");
+	};
+
+	auto producer = produce();
+	assert(producer.is_ready());
+	assert(consumer1.is_ready());
+	assert(consumer2.is_ready());
+
+	const std::vector<std::string> expected{ "a", "b", "c" };
+	assert(received1 == expected);
+	assert(received2 == expected);
+}
+
+void testAsyncBroadcastLagPolicySkipsOverwrittenMessages()
+{
+	cppcoro::async_broadcast<int> broadcast{ 2, cppcoro::async_broadcast_policy::lag };
+	auto subscriber = broadcast.subscribe();
+
+	auto produce = [&]() -> cppcoro::task<>
+	{
+		for (int i = 0; i < 5; ++i)
+		{
+			co_await broadcast.publish(i);
+		}
+	};
+
+	// Producer is never blocked by the slow subscriber.
+	auto producer = produce();
+	assert(producer.is_ready());
+	assert(subscriber.available());
+
+	auto consume = [&]() -> cppcoro::task<>
+	{
+		auto message = co_await subscriber.next();
+		assert(message.value() == 3);
+		assert(message.skipped_count() == 3);
+
+		message = co_await subscriber.next();
+		assert(message.value() == 4);
+		assert(message.skipped_count() == 0);
+	};
+
+	auto consumer = consume();
+	assert(consumer.is_ready());
+	assert(!subscriber.available());
+}
+
+void testAsyncBroadcastLagSubscriberReceivingConcurrentlyWithProducer()
+{
+	// With a single slot, a subscriber receiving on another thread regularly
+	// finds the producer has overwritten the message it wanted.
+	constexpr int messageCount = 2000;
+	cppcoro::async_broadcast<std::string> broadcast{ 1, cppcoro::async_broadcast_policy::lag };
+	auto subscriber = broadcast.subscribe();
+
+	int last = -1;
+	std::uint64_t receivedCount = 0;
+	std::uint64_t skippedCount = 0;
+	auto receiveOne = [&]() -> cppcoro::task<>
+	{
+		auto message = co_await subscriber.next();
+		const int value = std::stoi(message.value());
+		assert(value == last + 1 + static_cast<int>(message.skipped_count()));
+		last = value;
+		++receivedCount;
+		skippedCount += message.skipped_count();
+	};
+
+	std::thread consumerThread{ [&]
+	{
+		while (last != messageCount - 1)
+		{
+			auto t = receiveOne();
+			while (!t.is_ready())
+			{
+				std::this_thread::yield();
+			}
+		}
+	} };
+
+	auto produce = [&]() -> cppcoro::task<>
+	{
+		for (int i = 0; i < messageCount; ++i)
+		{
+			co_await broadcast.publish(std::to_string(i) + std::string(1000, 'x'));
+		}
+	};
+
+	auto producer = produce();
+	assert(producer.is_ready());
+
+	consumerThread.join();
+	assert(receivedCount + skippedCount == messageCount);
+}
+
+void testAsyncBroadcastLagProducerDoesntWaitForSubscriberCopyingMessage()
+{
+	// Copying blocks while 'stall' is set.
+	struct stalling_copy
+	{
+		stalling_copy(int value, std::atomic<bool>& stall, std::atomic<bool>& copying)
+			: m_value(value)
+			, m_stall(&stall)
+			, m_copying(&copying)
+		{}
+
+		stalling_copy(const stalling_copy& other)
+			: m_value(other.m_value)
+			, m_stall(other.m_stall)
+			, m_copying(other.m_copying)
+		{
+			m_copying->store(true);
+			while (m_stall->load())
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		stalling_copy(stalling_copy&& other) = default;
+
+		int m_value;
+		std::atomic<bool>* m_stall;
+		std::atomic<bool>* m_copying;
+	};
+
+	std::atomic<bool> stall{ true };
+	std::atomic<bool> copying{ false };
+
+	cppcoro::async_broadcast<stalling_copy> broadcast{ 2, cppcoro::async_broadcast_policy::lag };
+	auto subscriber = broadcast.subscribe();
+
+	auto publish = [&](int first, int count) -> cppcoro::task<>
+	{
+		for (int i = first; i < first + count; ++i)
+		{
+			co_await broadcast.publish(stalling_copy{ i, stall, copying });
+		}
+	};
+
+	auto firstPublish = publish(0, 1);
+	assert(firstPublish.is_ready());
+
+	int received = -1;
+	std::uint64_t skipped = 0;
+	auto receive = [&]() -> cppcoro::task<>
+	{
+		auto message = co_await subscriber.next();
+		received = message.value().m_value;
+		skipped = message.skipped_count();
+	};
+
+	std::thread consumerThread{ [&]
+	{
+		auto t = receive();
+		assert(t.is_ready());
+	} };
+
+	while (!copying.load())
+	{
+		std::this_thread::yield();
+	}
+
+	// Overwrite the message being copied, several times over.
+	auto secondPublish = publish(1, 10);
+	assert(secondPublish.is_ready());
+
+	stall = false;
+	consumerThread.join();
+	assert(received == 0);
+	assert(skipped == 0);
+
+	auto t = receive();
+	assert(t.is_ready());
+	assert(received == 9);
+	assert(skipped == 8);
+}
+
+void testAsyncBroadcastBackpressurePolicySuspendsProducer()
+{
+	cppcoro::async_broadcast<int> broadcast{ 2, cppcoro::async_broadcast_policy::backpressure };
+	auto subscriber = broadcast.subscribe();
+
+	int published = 0;
+	auto produce = [&]() -> cppcoro::task<>
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			co_await broadcast.publish(i);
+			++published;
+		}
+	};
+
+	auto producer = produce();
+	assert(!producer.is_ready());
+	assert(published == 2);
+
+	std::vector<int> received;
+	auto consume = [&]() -> cppcoro::task<>
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			auto message = co_await subscriber.next();
+			assert(message.skipped_count() == 0);
+			received.push_back(message.value());
+		}
+	};
+
+	auto consumer = consume();
+	assert(producer.is_ready());
+	assert(consumer.is_ready());
+	assert(published == 4);
+	assert((received == std::vector<int>{ 0, 1, 2, 3 }));
+}
+
+void testRetrySucceedsAfterTransientFailures()
+{
+	class X {};
+
+	int attempts = 0;
+	auto factory = [&]() -> cppcoro::lazy_task<int>
+	{
+		if (++attempts < 3)
+		{
+			throw X{};
+		}
+
+		co_return 123;
+	};
+
+	std::vector<std::chrono::nanoseconds> delays;
+	auto delay = [&](std::chrono::nanoseconds d)
+	{
+		delays.push_back(d);
+		return std::experimental::suspend_never{};
+	};
+
+	cppcoro::retry_policy policy{
+		5,
+		std::chrono::milliseconds(10),
+		std::chrono::milliseconds(15) };
+
+	auto t = cppcoro::retry(factory, policy, delay);
+	assert(attempts == 0);
+
+	[&]() -> cppcoro::task<>
+	{
+		assert(co_await t == 123);
+	}();
+
+	assert(attempts == 3);
+	assert(delays.size() == 2);
+	assert(delays[0] <= std::chrono::milliseconds(10));
+	assert(delays[1] <= std::chrono::milliseconds(15));
+	assert(policy.max_backoff(1) == std::chrono::milliseconds(10));
+	assert(policy.max_backoff(2) == std::chrono::milliseconds(15));
+}
+
+void testRetryRethrowsAfterMaxAttempts()
+{
+	class X {};
+
+	int attempts = 0;
+	auto factory = [&]() -> cppcoro::lazy_task<>
+	{
+		++attempts;
+		throw X{};
+		co_return;
+	};
+
+	bool ok = false;
+	[&]() -> cppcoro::task<>
+	{
+		try
+		{
+			co_await cppcoro::retry(factory, cppcoro::retry_policy{ 3 });
+		}
+		catch (X)
+		{
+			ok = true;
+		}
+	}();
+
+	assert(ok);
+	assert(attempts == 3);
+}
+
+void testRetryStopsWhenBudgetExhausted()
+{
+	class X {};
+
+	cppcoro::retry_budget budget{ 0.5, 2 };
+	assert(budget.available_tokens() == 2);
+
+	int attempts = 0;
+	auto factory = [&]() -> cppcoro::lazy_task<>
+	{
+		++attempts;
+		throw X{};
+		co_return;
+	};
+
+	cppcoro::retry_policy policy{ 10, std::chrono::nanoseconds(0), std::chrono::nanoseconds(0), 2.0, &budget };
+
+	auto run = [&]() -> cppcoro::task<>
+	{
+		try
+		{
+			co_await cppcoro::retry(factory, policy);
+		}
+		catch (X)
+		{
+		}
+	};
+
+	// Budget only allows two retries despite policy allowing nine.
+	run();
+	assert(attempts == 3);
+	assert(budget.available_tokens() == 0);
+
+	// Each call deposits half a token.
+	attempts = 0;
+	run();
+	assert(attempts == 1);
+	run();
+	assert(attempts == 3);
+}
+
+void testWaitAnyResumesOnFirstEventAndUnregistersFromOthers()
+{
+	cppcoro::single_consumer_event a;
+	cppcoro::single_consumer_event b;
+	cppcoro::single_consumer_event c;
+
+	std::size_t result = 99;
+	auto f = [&]() -> cppcoro::task<>
+	{
+		result = co_await cppcoro::wait_any(a, b, c);
+	};
+
+	auto t = f();
+	assert(!t.is_ready());
+
+	b.set();
+	assert(t.is_ready());
+	assert(result == 1);
+
+	// Setting the other events no longer resumes anything.
+	a.set();
+	c.set();
+
+	// And a new awaiter can wait on an event that lost the race.
+	cppcoro::single_consumer_event d;
+	auto t2 = [&]() -> cppcoro::task<>
+	{
+		result = co_await cppcoro::wait_any(d, b);
+	}();
+	assert(t2.is_ready());
+	assert(result == 1);
+}
+
+void testWaitAnyCompletesSynchronouslyIfEventAlreadySet()
+{
+	cppcoro::single_consumer_event a;
+	cppcoro::single_consumer_event b{ true };
+
+	std::size_t result = 99;
+	auto f = [&]() -> cppcoro::task<>
+	{
+		result = co_await cppcoro::wait_any(a, b);
+	};
+
+	auto t = f();
+	assert(t.is_ready());
+	assert(result == 1);
+
+	// Losing event can still be awaited normally.
+	bool resumed = false;
+	auto g = [&]() -> cppcoro::task<>
+	{
+		co_await a;
+		resumed = true;
+	};
+
+	auto t2 = g();
+	assert(!resumed);
+	a.set();
+	assert(resumed);
+}
+
+void testSingleConsumerEventDoesntRetainWaiterThatFailedToRegister()
+{
+	struct counting_waiter : cppcoro::single_consumer_event_waiter
+	{
+		int notifyCount = 0;
+
+		counting_waiter()
+		{
+			m_notify = [](cppcoro::single_consumer_event_waiter* waiter) noexcept
+			{
+				++static_cast<counting_waiter*>(waiter)->notifyCount;
+			};
+		}
+	};
+
+	cppcoro::single_consumer_event event{ true };
+
+	counting_waiter rejected;
+	assert(!event.try_add_waiter(&rejected));
+
+	// Reusing the event after a rejected registration must only ever
+	// notify the waiter that is currently registered.
+	event.reset();
+	counting_waiter accepted;
+	assert(event.try_add_waiter(&accepted));
+	event.set();
+	assert(accepted.notifyCount == 1);
+	assert(rejected.notifyCount == 0);
+
+	assert(!event.try_add_waiter(&rejected));
+	event.reset();
+
+	bool resumed = false;
+	auto f = [&]() -> cppcoro::task<>
+	{
+		co_await event;
+		resumed = true;
+	};
+
+	auto t = f();
+	event.set();
+	assert(resumed);
+	assert(t.is_ready());
+	assert(rejected.notifyCount == 0);
+}
+
+void testWaitAnyIgnoresEventsSetAfterAnotherHasWon()
+{
+	for (int i = 0; i < 1000; ++i)
+	{
+		cppcoro::single_consumer_event a;
+		cppcoro::single_consumer_event b;
+		cppcoro::single_consumer_event c;
+
+		std::size_t result = 99;
+		auto f = [&]() -> cppcoro::task<>
+		{
+			result = co_await cppcoro::wait_any(a, b, c);
+		};
+
+		// 'c' may be set before, during or after registration and may win or
+		// lose the race with 'b'.
+		std::thread thread{ [&] { c.set(); } };
+		auto t = f();
+		b.set();
+		thread.join();
+
+		assert(t.is_ready());
+		assert(result == 1 || result == 2);
+
+		// 'a' was unregistered by whichever event won, so it can be awaited
+		// again and set from another thread.
+		bool resumed = false;
+		auto g = [&]() -> cppcoro::task<>
+		{
+			co_await a;
+			resumed = true;
+		};
+
+		auto t2 = g();
+		std::thread{ [&] { a.set(); } }.join();
+		assert(resumed);
+		assert(t2.is_ready());
+	}
+}
+
+void testWaitAllResumesAfterLastEvent()
+{
+	cppcoro::single_consumer_event a;
+	cppcoro::single_consumer_event b{ true };
+	cppcoro::single_consumer_event c;
+
+	auto f = [&]() -> cppcoro::task<>
+	{
+		co_await cppcoro::wait_all(a, b, c);
+	};
+
+	auto t = f();
+	assert(!t.is_ready());
+	c.set();
+	assert(!t.is_ready());
+	a.set();
+	assert(t.is_ready());
+}
+
+void testLocalRunLoopQueuesResumptionsUntilRun()
+{
+	cppcoro::single_consumer_event event;
+	cppcoro::single_consumer_event inlineEvent;
+
+	bool resumed = false;
+	auto f = [&]() -> cppcoro::task<>
+	{
+		co_await event;
+		co_await cppcoro::local_run_loop::schedule();
+		resumed = true;
+	};
+
+	bool resumedInline = false;
+	auto g = [&]() -> cppcoro::task<>
+	{
+		co_await inlineEvent;
+		resumedInline = true;
+	};
+
+	auto t = f();
+	auto t2 = g();
+
+	{
+		cppcoro::local_run_loop loop;
+		assert(cppcoro::local_run_loop::current() == &loop);
+
+		event.set();
+		assert(!resumed);
+		assert(!loop.empty());
+
+		// Coroutines that haven't opted in are still resumed inline.
+		inlineEvent.set();
+		assert(resumedInline);
+
+		loop.run();
+		assert(resumed);
+		assert(loop.empty());
+	}
+
+	assert(cppcoro::local_run_loop::current() == nullptr);
+}
+
+void testLocalRunLoopScheduleCompletesSynchronouslyWithoutRunLoop()
+{
+	bool completed = false;
+	auto f = [&]() -> cppcoro::task<>
+	{
+		co_await cppcoro::local_run_loop::schedule();
+		completed = true;
+	};
+
+	auto t = f();
+	assert(completed);
+	assert(t.is_ready());
+}
+
+void testLocalRunLoopDrainsLongChainIteratively()
+{
+	// Each coroutine awaits the previous one. Without the run loop completing
+	// the first would resume the whole chain recursively.
+	constexpr int chainLength = 100000;
+
+	cppcoro::single_consumer_event event;
+	int completedCount = 0;
+
+	auto first = [&]() -> cppcoro::task<>
+	{
+		co_await event;
+		co_await cppcoro::local_run_loop::schedule();
+		++completedCount;
+	};
+
+	auto next = [&](cppcoro::task<>& previous) -> cppcoro::task<>
+	{
+		co_await previous;
+		co_await cppcoro::local_run_loop::schedule();
+		++completedCount;
+	};
+
+	std::vector<cppcoro::task<>> tasks;
+	tasks.reserve(chainLength);
+	tasks.push_back(first());
+
+	{
+		cppcoro::local_run_loop loop;
+		for (int i = 1; i < chainLength; ++i)
+		{
+			tasks.push_back(next(tasks.back()));
+		}
+
+		event.set();
+		assert(completedCount == 0);
+	}
+
+	assert(completedCount == chainLength);
+	assert(tasks.back().is_ready());
+}
+
+void testLocalRunLoopResumesAsyncMutexWaiters()
+{
+	cppcoro::async_mutex mutex;
+	std::vector<int> order;
+
+	auto f = [&](int id) -> cppcoro::task<>
+	{
+		cppcoro::async_mutex_lock lock = co_await mutex.lock_async();
+		co_await cppcoro::local_run_loop::schedule();
+		order.push_back(id);
+	};
+
+	cppcoro::local_run_loop loop;
+
+	mutex.try_lock();
+	auto t1 = f(1);
+	auto t2 = f(2);
+	assert(order.empty());
+
+	mutex.unlock();
+	assert(order.empty());
+
+	loop.run();
+	assert((order == std::vector<int>{ 1, 2 }));
+	assert(t1.is_ready());
+	assert(t2.is_ready());
+}
+
+namespace
+{
+	std::uintptr_t stack_address_impl()
+	{
+		volatile char marker = 0;
+		return reinterpret_cast<std::uintptr_t>(&marker);
+	}
+
+	// Called through a volatile pointer so it can't be inlined into the
+	// coroutine body, where the marker could end up in the coroutine frame.
+	std::uintptr_t (*volatile stack_address)() = &stack_address_impl;
+}
+
+void testLocalRunLoopCapturingResumptionsKeepsStackDepthConstant()
+{
+	constexpr int chainLength = 10000;
+
+	std::uintptr_t minStack = UINTPTR_MAX;
+	std::uintptr_t maxStack = 0;
+	auto recordStackDepth = [&]
+	{
+		const std::uintptr_t address = stack_address();
+		minStack = std::min(minStack, address);
+		maxStack = std::max(maxStack, address);
+	};
+
+	// Each link sets the event the next link is waiting on. Without the
+	// run loop each set() would resume the next link recursively.
+	std::vector<cppcoro::single_consumer_event> events(chainLength + 1);
+	auto link = [&](int i) -> cppcoro::task<>
+	{
+		co_await events[i];
+		recordStackDepth();
+		events[i + 1].set();
+	};
+
+	std::vector<cppcoro::task<>> tasks;
+	for (int i = 0; i < chainLength; ++i)
+	{
+		tasks.push_back(link(i));
+	}
+
+	{
+		cppcoro::local_run_loop loop{ 256, cppcoro::local_run_loop_mode::all_resumptions };
+		events[0].set();
+		assert(!tasks[0].is_ready());
+	}
+
+	assert(std::all_of(tasks.begin(), tasks.end(), [](const cppcoro::task<>& t) { return t.is_ready(); }));
+	assert(maxStack - minStack < 1024);
+
+	// Each lock holder's unlock() hands the mutex to the next waiter.
+	cppcoro::async_mutex mutex;
+	int lockCount = 0;
+	auto lockAndUnlock = [&]() -> cppcoro::task<>
+	{
+		cppcoro::async_mutex_lock lock = co_await mutex.lock_async();
+		recordStackDepth();
+		++lockCount;
+	};
+
+	minStack = UINTPTR_MAX;
+	maxStack = 0;
+	tasks.clear();
+	mutex.try_lock();
+	for (int i = 0; i < chainLength; ++i)
+	{
+		tasks.push_back(lockAndUnlock());
+	}
+
+	{
+		cppcoro::local_run_loop loop{ 256, cppcoro::local_run_loop_mode::all_resumptions };
+		mutex.unlock();
+		assert(lockCount == 0);
+	}
+
+	assert(lockCount == chainLength);
+	assert(maxStack - minStack < 1024);
+	assert(mutex.try_lock());
+}
+
+void testLocalRunLoopStopsCapturingResumptionsWhenDestroyed()
+{
+	cppcoro::single_consumer_event event;
+	bool resumed = false;
+
+	auto f = [&]() -> cppcoro::task<>
+	{
+		co_await event;
+		resumed = true;
+	};
+
+	{
+		cppcoro::local_run_loop loop{ 16, cppcoro::local_run_loop_mode::all_resumptions };
+	}
+
+	auto t = f();
+	event.set();
+	assert(resumed);
+	assert(t.is_ready());
+}
+
+void testOffloadRunsFunctionOnExecutorThread()
+{
+	const auto callerThreadId = std::this_thread::get_id();
+	std::thread::id functionThreadId;
+	std::thread::id resumedThreadId;
+	std::string result;
+
+	cppcoro::task<> t;
+	{
+		cppcoro::blocking_executor executor{ 2 };
+
+		auto f = [&]() -> cppcoro::task<>
+		{
+			result = co_await cppcoro::offload(executor, [&]
+			{
+				functionThreadId = std::this_thread::get_id();
+				return std::string("hello");
+			});
+			resumedThreadId = std::this_thread::get_id();
+		};
+
+		t = f();
+
+		// Executor destructor waits for queued work to complete.
+	}
+
+	assert(t.is_ready());
+	assert(result == "hello");
+	assert(functionThreadId != callerThreadId);
+	assert(resumedThreadId == functionThreadId);
+}
+
+void testOffloadRethrowsExceptionAndRecordsStatistics()
+{
+	class X {};
+
+	bool ok = false;
+	cppcoro::task<> t;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+
+	{
+		cppcoro::blocking_executor executor{ 1 };
+
+		auto f = [&]() -> cppcoro::task<>
+		{
+			co_await cppcoro::offload(executor, [] {});
+
+			try
+			{
+				co_await cppcoro::offload(executor, []() -> int { throw X{}; });
+			}
+			catch (X)
+			{
+				ok = true;
+			}
+
+			std::lock_guard<std::mutex> lock{ mutex };
+			done = true;
+			cv.notify_one();
+		};
+
+		t = f();
+
+		{
+			std::unique_lock<std::mutex> lock{ mutex };
+			cv.wait(lock, [&] { return done; });
+		}
+
+		auto stats = executor.stats();
+		assert(executor.thread_count() == 1);
+		assert(stats.queueDepth == 0);
+		assert(stats.completedCount == 2);
+		assert(stats.totalRunTime.count() >= 0);
+		assert(stats.totalQueueTime.count() >= 0);
+
+		// The worker may still be finishing the coroutine after notifying,
+		// so join it before the mutex and condition variable are destroyed.
+	}
+
+	assert(t.is_ready());
+	assert(ok);
+}
+
+void testOffloadResumesAwaiterThroughResumer()
+{
+	const auto callerThreadId = std::this_thread::get_id();
+	std::thread::id resumedThreadId;
+	int result = 0;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<std::experimental::coroutine_handle<>> posted;
+
+	cppcoro::blocking_executor executor{ 1 };
+
+	auto post = [&](std::experimental::coroutine_handle<> awaiter) noexcept
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		posted.push_back(awaiter);
+		cv.notify_one();
+	};
+
+	auto f = [&]() -> cppcoro::task<>
+	{
+		result = co_await cppcoro::offload(executor, [] { return 42; }, post);
+		resumedThreadId = std::this_thread::get_id();
+	};
+
+	auto t = f();
+
+	std::experimental::coroutine_handle<> awaiter;
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		cv.wait(lock, [&] { return !posted.empty(); });
+		awaiter = posted.front();
+	}
+
+	assert(!t.is_ready());
+	awaiter.resume();
+
+	assert(t.is_ready());
+	assert(result == 42);
+	assert(resumedThreadId == callerThreadId);
+}
+
+void testEpochRetireReclaimsOnceUnreferenced()
+{
+	counter::reset_counts();
+
+	for (int i = 0; i < 10; ++i)
+	{
+		cppcoro::epoch_retire(new counter());
+	}
+
+	assert(counter::active_count() == 10);
+
+	// Needs a couple of epoch advances before the objects can be reclaimed.
+	std::size_t pending = 10;
+	for (int i = 0; i < 3 && pending != 0; ++i)
+	{
+		pending = cppcoro::epoch_collect();
+	}
+
+	assert(pending == 0);
+	assert(counter::active_count() == 0);
+}
+
+void testEpochGuardDelaysReclamation()
+{
+	counter::reset_counts();
+
+	std::atomic<counter*> shared{ new counter() };
+
+	{
+		cppcoro::epoch_guard guard;
+		counter* value = shared.load();
+
+		shared.store(nullptr);
+		cppcoro::epoch_retire(value);
+
+		for (int i = 0; i < 5; ++i)
+		{
+			assert(cppcoro::epoch_collect() == 1);
+		}
+
+		// Still safe to access.
+		assert(value->id == 0);
+		assert(counter::active_count() == 1);
+	}
+
+	std::size_t pending = 1;
+	for (int i = 0; i < 3 && pending != 0; ++i)
+	{
+		pending = cppcoro::epoch_collect();
+	}
+
+	assert(pending == 0);
+	assert(counter::active_count() == 0);
+}
+
+void testHazardPointerProtectsAcrossSuspension()
+{
+	counter::reset_counts();
+
+	std::atomic<counter*> shared{ new counter() };
+	cppcoro::single_consumer_event event;
+
+	auto reader = [&]() -> cppcoro::task<int>
+	{
+		cppcoro::hazard_pointer hazard;
+		counter* value = hazard.protect(shared);
+		co_await event;
+		co_return value->id;
+	};
+
+	auto t = reader();
+
+	counter* old = shared.exchange(nullptr);
+	cppcoro::epoch_retire(old);
+	for (int i = 0; i < 5; ++i)
+	{
+		assert(cppcoro::epoch_collect() == 1);
+	}
+
+	event.set();
+	assert(t.is_ready());
+
+	std::size_t pending = 1;
+	for (int i = 0; i < 3 && pending != 0; ++i)
+	{
+		pending = cppcoro::epoch_collect();
+	}
+
+	assert(pending == 0);
+	assert(counter::active_count() == 0);
+}
+
+void testConcurrentHashMapInsertFindErase()
+{
+	cppcoro::concurrent_hash_map<std::string, int> map;
+
+	assert(map.insert("a", 1));
+	assert(map.insert("b", 2));
+	assert(!map.insert("a", 3));
+	assert(map.size() == 2);
+
+	int value = 0;
+	assert(map.find("a", value) && value == 1);
+	assert(map.find("b", value) && value == 2);
+	assert(!map.find("c", value));
+
+	assert(!map.insert_or_assign("a", 10));
+	assert(map.find("a", value) && value == 10);
+	assert(map.insert_or_assign("c", 3));
+
+	assert(map.erase("b"));
+	assert(!map.erase("b"));
+	assert(!map.contains("b"));
+	assert(map.contains("a"));
+	assert(map.contains("c"));
+	assert(map.size() == 2);
+}
+
+void testConcurrentHashMapGrowsAndKeepsEntries()
+{
+	counter::reset_counts();
+
+	{
+		cppcoro::concurrent_hash_map<int, std::shared_ptr<counter>> map{ 4 };
+		for (int i = 0; i < 10000; ++i)
+		{
+			auto c = std::make_shared<counter>();
+			c->id = i;
+			assert(map.insert(i, std::move(c)));
+
+			// Entries are readable while the table is being migrated.
+			if (i % 97 == 0)
+			{
+				for (int j = 0; j <= i; j += 13)
+				{
+					assert(map.contains(j));
+				}
+			}
+		}
+
+		assert(map.size() == 10000);
+		assert(map.bucket_count() >= 4096);
+
+		for (int i = 0; i < 10000; i += 2)
+		{
+			assert(map.erase(i));
+		}
+
+		std::shared_ptr<counter> c;
+		for (int i = 0; i < 10000; ++i)
+		{
+			const bool found = map.find(i, c);
+			assert(found == (i % 2 != 0));
+			assert(!found || c->id == i);
+		}
+	}
+
+	// Wait for retired nodes and tables to be reclaimed.
+	std::size_t pending = 1;
+	for (int i = 0; i < 3 && pending != 0; ++i)
+	{
+		pending = cppcoro::epoch_collect();
+	}
+
+	assert(pending == 0);
+	assert(counter::active_count() == 0);
+}
+
+void testConcurrentHashMapConcurrentInsertFindEraseWhileGrowing()
+{
+	constexpr int threadCount = 8;
+	constexpr int keysPerThread = 5000;
+	constexpr int sharedKeyCount = 64;
+
+	// Starts small so that the table is resized many times while all of
+	// the threads are writing to it.
+	cppcoro::concurrent_hash_map<int, int> map{ 4 };
+
+	std::atomic<int> startedCount{ 0 };
+
+	auto run = [&](int threadIndex)
+	{
+		++startedCount;
+		while (startedCount.load() < threadCount)
+		{
+			std::this_thread::yield();
+		}
+
+		const int firstKey = sharedKeyCount + threadIndex * keysPerThread;
+		int value = 0;
+
+		for (int key = firstKey; key < firstKey + keysPerThread; ++key)
+		{
+			assert(map.insert(key, key * 2));
+			assert(map.find(key, value) && value == key * 2);
+
+			// Keys owned by other threads may or may not be present yet,
+			// but must never have the wrong value.
+			const int otherKey = key + keysPerThread;
+			if (map.find(otherKey, value))
+			{
+				assert(value == otherKey * 2);
+			}
+
+			// Every thread writes to the shared keys.
+			const int sharedKey = key % sharedKeyCount;
+			if (key % 3 == 0)
+			{
+				map.erase(sharedKey);
+			}
+			else
+			{
+				map.insert_or_assign(sharedKey, sharedKey * 2);
+			}
+
+			if (map.find(sharedKey, value))
+			{
+				assert(value == sharedKey * 2);
+			}
+		}
+
+		for (int key = firstKey; key < firstKey + keysPerThread; key += 2)
+		{
+			assert(map.erase(key));
+			assert(!map.contains(key));
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < threadCount; ++i)
+	{
+		threads.emplace_back(run, i);
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	int value = 0;
+	std::size_t sharedKeysPresent = 0;
+	for (int key = 0; key < sharedKeyCount; ++key)
+	{
+		if (map.find(key, value))
+		{
+			assert(value == key * 2);
+			++sharedKeysPresent;
+		}
+	}
+
+	for (int key = sharedKeyCount; key < sharedKeyCount + threadCount * keysPerThread; ++key)
+	{
+		const bool found = map.find(key, value);
+		assert(found == (((key - sharedKeyCount) % keysPerThread) % 2 != 0));
+		assert(!found || value == key * 2);
+	}
+
+	assert(map.size() == sharedKeysPresent + threadCount * keysPerThread / 2);
+	assert(map.bucket_count() >= 16384);
+
+	// Nodes and tables retired by the exited threads are reclaimed too.
+	std::size_t pending = 1;
+	for (int i = 0; i < 3 && pending != 0; ++i)
+	{
+		pending = cppcoro::epoch_collect();
+	}
+
+	assert(pending == 0);
+}
+
+void testAsyncEventcountConsumerSuspendsUntilNotified()
+{
+	cppcoro::async_eventcount eventcount;
+	std::atomic<int> available{ 0 };
+
+	int consumed = 0;
+	auto consumer = [&]() -> cppcoro::task<>
+	{
+		while (consumed < 3)
+		{
+			int count = available.load();
+			if (count > 0 && available.compare_exchange_strong(count, count - 1))
+			{
+				++consumed;
+				continue;
+			}
+
+			auto key = eventcount.prepare_wait();
+			if (available.load() > 0)
+			{
+				eventcount.cancel_wait();
+				continue;
+			}
+
+			co_await eventcount.commit_wait(key);
+		}
+	};
+
+	auto t = consumer();
+	assert(!t.is_ready());
+
+	available.fetch_add(1);
+	eventcount.notify_one();
+	assert(consumed == 1);
+	assert(!t.is_ready());
+
+	available.fetch_add(2);
+	eventcount.notify_one();
+	assert(consumed == 3);
+	assert(t.is_ready());
+
+	// Nobody waiting, notify is a no-op.
+	eventcount.notify_all();
+}
+
+void testAsyncEventcountNotifyBetweenPrepareAndCommitIsNotLost()
+{
+	cppcoro::async_eventcount eventcount;
+
+	bool resumed = false;
+	auto waiter = [&]() -> cppcoro::task<>
+	{
+		auto key = eventcount.prepare_wait();
+
+		// Notification arrives before the waiter commits.
+		eventcount.notify_one();
+
+		co_await eventcount.commit_wait(key);
+		resumed = true;
+	};
+
+	auto t = waiter();
+	assert(resumed);
+	assert(t.is_ready());
+}
+
+void testAsyncEventcountNotifyAllResumesAllWaiters()
+{
+	cppcoro::async_eventcount eventcount;
+
+	int resumedCount = 0;
+	auto waiter = [&]() -> cppcoro::task<>
+	{
+		co_await eventcount.commit_wait(eventcount.prepare_wait());
+		++resumedCount;
+	};
+
+	auto t1 = waiter();
+	auto t2 = waiter();
+	auto t3 = waiter();
+	assert(resumedCount == 0);
+
+	eventcount.notify_one();
+	assert(resumedCount == 1);
+
+	eventcount.notify_all();
+	assert(resumedCount == 3);
+}
+
+void testAtomicWaitCompletesImmediatelyIfValueDiffers()
+{
+	std::atomic<int> value{ 1 };
+
+	bool resumed = false;
+	auto f = [&]() -> cppcoro::task<>
+	{
+		co_await cppcoro::atomic_wait(value, 0);
+		resumed = true;
+	};
+
+	auto t = f();
+	assert(resumed);
+	assert(t.is_ready());
+}
+
+void testAtomicWaitResumedByNotifyOnSameAddress()
+{
+	std::atomic<int> a{ 0 };
+	std::atomic<int> b{ 0 };
+
+	int resumedCount = 0;
+	auto waitOn = [&](std::atomic<int>& x) -> cppcoro::task<>
+	{
+		while (x.load() == 0)
+		{
+			co_await cppcoro::atomic_wait(x, 0);
+		}
+		++resumedCount;
+	};
+
+	auto t1 = waitOn(a);
+	auto t2 = waitOn(a);
+	auto t3 = waitOn(b);
+	assert(resumedCount == 0);
+
+	// Notifying another address doesn't wake anyone.
+	b.store(1);
+	cppcoro::atomic_notify_all(&a);
+	assert(resumedCount == 0);
+
+	a.store(1);
+	cppcoro::atomic_notify_one(&a);
+	assert(resumedCount == 1);
+	assert(t1.is_ready());
+
+	cppcoro::atomic_notify_all(&a);
+	assert(resumedCount == 2);
+	assert(t2.is_ready());
+
+	cppcoro::atomic_notify_one(&b);
+	assert(resumedCount == 3);
+	assert(t3.is_ready());
+}
+
+void testReducerMergesPerThreadViews()
+{
+	cppcoro::reducer<cppcoro::sum_monoid<std::uint64_t>> sum;
+	cppcoro::reducer<cppcoro::min_monoid<int>> minimum;
+	cppcoro::reducer<cppcoro::max_monoid<int>> maximum;
+
+	constexpr int threadCount = 4;
+	constexpr int perThreadCount = 1000;
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			for (int i = 0; i < perThreadCount; ++i)
+			{
+				const int value = t * perThreadCount + i;
+				sum.view() += value;
+				auto& lowest = minimum.view();
+				lowest = std::min(lowest, value);
+				auto& highest = maximum.view();
+				highest = std::max(highest, value);
+			}
+		});
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	constexpr std::uint64_t n = threadCount * perThreadCount;
+	assert(sum.get() == n * (n - 1) / 2);
+	assert(minimum.get() == 0);
+	assert(maximum.get() == static_cast<int>(n - 1));
+}
+
+void testReducerAppendAndHistogram()
+{
+	cppcoro::reducer<cppcoro::append_monoid<int>> values;
+	cppcoro::reducer<cppcoro::histogram_monoid<std::string>> histogram;
+
+	// Untouched reducers yield the identity.
+	assert(values.get().empty());
+	assert(histogram.get().empty());
+
+	auto worker = [&](int first, int last) -> cppcoro::task<>
+	{
+		for (int i = first; i < last; ++i)
+		{
+			values.view().push_back(i);
+			++histogram.view()[i % 2 == 0 ? "even" : "odd"];
+		}
+		co_return;
+	};
+
+	auto t1 = worker(0, 5);
+	std::thread other{ [&] { auto t2 = worker(5, 10); } };
+	other.join();
+
+	auto result = values.get();
+	std::sort(result.begin(), result.end());
+	assert((result == std::vector<int>{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }));
+
+	auto counts = histogram.get();
+	assert(counts.size() == 2);
+	assert(counts["even"] == 5);
+	assert(counts["odd"] == 5);
+
+	// get() doesn't consume the views.
+	assert(values.get().size() == 10);
+}
+
+void testReducerTakeMovesViewsIntoResult()
+{
+	// The elements are move-only, so take() can't be copying the views.
+	cppcoro::reducer<cppcoro::append_monoid<std::unique_ptr<int>>> values;
+
+	auto& mainView = values.view();
+	mainView.push_back(std::make_unique<int>(1));
+	mainView.push_back(std::make_unique<int>(2));
+	const int* mainElement = mainView[0].get();
+	std::thread{ [&] { values.view().push_back(std::make_unique<int>(3)); } }.join();
+
+	auto result = values.take();
+	assert(result.size() == 3);
+	assert(std::any_of(result.begin(), result.end(), [&](const std::unique_ptr<int>& p)
+	{
+		return p.get() == mainElement;
+	}));
+
+	int total = 0;
+	for (auto& p : result)
+	{
+		total += *p;
+	}
+	assert(total == 6);
+
+	// The views are left at the identity and can be reused.
+	assert(mainView.empty());
+	mainView.push_back(std::make_unique<int>(4));
+	auto second = values.take();
+	assert(second.size() == 1);
+	assert(*second[0] == 4);
+}
+
+void testKeyedExecutorRunsSameKeyInSubmissionOrder()
+{
+	cppcoro::keyed_executor<std::string> executor;
+	cppcoro::single_consumer_event events[4];
+
+	std::string log;
+	auto work = [&](std::string key, char id, cppcoro::single_consumer_event& done) -> cppcoro::task<>
+	{
+		auto turn = co_await executor.schedule(key);
+		log += id;
+		co_await done;
+		log += static_cast<char>(id - 'a' + 'A');
+	};
+
+	auto a1 = work("a", 'a', events[0]);
+	auto a2 = work("a", 'b', events[1]);
+	auto b1 = work("b", 'c', events[2]);
+	auto a3 = work("a", 'd', events[3]);
+
+	// Only the first coroutine for "a" has started, "b" runs in parallel.
+	assert(log == "ac");
+	assert(executor.active_key_count() == 2);
+
+	// Ending "b" doesn't affect "a".
+	events[2].set();
+	assert(log == "acC");
+	assert(b1.is_ready());
+	assert(executor.active_key_count() == 1);
+
+	// Completing a later "a" coroutine's work doesn't let it jump the queue.
+	events[3].set();
+	assert(log == "acC");
+
+	events[0].set();
+	assert(log == "acCAb");
+
+	events[1].set();
+	assert(log == "acCAbBdD");
+	assert(a1.is_ready());
+	assert(a2.is_ready());
+	assert(a3.is_ready());
+
+	// The queue for "a" is reclaimed once empty.
+	assert(executor.active_key_count() == 0);
+}
+
+void testKeyedExecutorSerialisesKeyAcrossThreads()
+{
+	cppcoro::keyed_executor<int> executor;
+
+	constexpr int keyCount = 4;
+	constexpr int threadCount = 4;
+	constexpr int iterationCount = 1000;
+
+	// Not atomic, only ever accessed during a turn on the key.
+	int counts[keyCount] = {};
+	bool inside[keyCount] = {};
+
+	auto work = [&](int key) -> cppcoro::task<>
+	{
+		auto turn = co_await executor.schedule(key);
+		assert(!inside[key]);
+		inside[key] = true;
+		++counts[key];
+		inside[key] = false;
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			std::vector<cppcoro::task<>> tasks;
+			for (int i = 0; i < iterationCount; ++i)
+			{
+				tasks.push_back(work((t + i) % keyCount));
+			}
+
+			// Queued coroutines are resumed by the thread ending the previous
+			// turn for their key, so they may still be running elsewhere.
+			for (auto& task : tasks)
+			{
+				while (!task.is_ready())
+				{
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	for (int key = 0; key < keyCount; ++key)
+	{
+		assert(counts[key] == threadCount * iterationCount / keyCount);
+	}
+
+	assert(executor.active_key_count() == 0);
+}
+
+int main(int argc, char** argv)
+{
+	testAwaitSynchronouslyCompletingVoidFunction();
+	testAwaitTaskReturningMoveOnlyType();
+	testAwaitTaskReturningReference();
+	testAwaitDelayedCompletionChain();
+	testAwaitTaskReturningValueMovesIntoPromiseIfPassedRValue();
+	testAwaitTaskReturningValueCopiesIntoPromiseIfPassedLValue();
+	testAwaitingBrokenPromiseThrows();
+	testAwaitRethrowsException();
+	testAwaitWhenReadyDoesntThrowException();
+
+	testLazyTaskDoesntStartUntilAwaited();
+	testAwaitingDefaultConstructedLazyTaskThrowsBrokenPromise();
+	testAwaitingLazyTaskThatCompletesAsynchronously();
+	testLazyTaskResultLifetime();
+	testLazyTaskNeverAwaitedDestroysCapturedArgs();
+	testLazyTaskReturnByReference();
+
+	// NOTE: Test is disabled as MSVC 2017.1 compiler is currently
+	// failing the test as it calls move-constructor twice for the
+	// captured parameter value. Need to check whether this is a
+	// bug or something that is unspecified in standard.
+	//testPassingParameterByValueToLazyTaskCallsMoveConstructorOnce();
+
+	testStartLazyTaskStartsExecutionImmediately();
+	testStartLazyTaskDoesntMoveResult();
+	testStartLazyTaskRethrowsException();
+	testStartLazyTaskThenShareIt();
+	testLazyTaskFramesFreedOutOfOrderAreNotReused();
+	testLazyTaskFramesFreedOutOfOrderAreReclaimed();
+	testLazyTaskFramesFreedOnAnotherThreadAreReclaimed();
+	testDeeplyNestedLazyTaskChainReusesFrames();
 
 	testAsyncMutex();
 
@@ -842,6 +2889,64 @@ int main(int argc, char** argv)
 	testSharedTaskReturningRValueReferenceMovesIntoPromise();
 	testSharedTaskEquality();
 	testMakeSharedTask();
+	testMakeSharedTaskDoesntMoveOrCopyResult();
+	testMakeSharedTaskFromLazyTask();
+	testDetachedTaskDestroysFrameWhenItCompletes();
+	testSharedTaskFromLazyTaskDestroysFrameAfterLastCopyAndCompletion();
+
+	testAsyncWatchCurrentValue();
+	testAsyncWatchNextSkipsIntermediateValues();
+	testAsyncWatchMultipleSubscribers();
+	testAsyncWatchNextWaitsPastVersionsNotYetSeen();
+
+	testAsyncBroadcastEverySubscriberSeesEveryMessage();
+	testAsyncBroadcastLagPolicySkipsOverwrittenMessages();
+	testAsyncBroadcastLagSubscriberReceivingConcurrentlyWithProducer();
+	testAsyncBroadcastLagProducerDoesntWaitForSubscriberCopyingMessage();
+	testAsyncBroadcastBackpressurePolicySuspendsProducer();
+
+	testRetrySucceedsAfterTransientFailures();
+	testRetryRethrowsAfterMaxAttempts();
+	testRetryStopsWhenBudgetExhausted();
+
+	testWaitAnyResumesOnFirstEventAndUnregistersFromOthers();
+	testWaitAnyCompletesSynchronouslyIfEventAlreadySet();
+	testWaitAnyIgnoresEventsSetAfterAnotherHasWon();
+	testSingleConsumerEventDoesntRetainWaiterThatFailedToRegister();
+	testWaitAllResumesAfterLastEvent();
+
+	testLocalRunLoopQueuesResumptionsUntilRun();
+	testLocalRunLoopScheduleCompletesSynchronouslyWithoutRunLoop();
+	testLocalRunLoopDrainsLongChainIteratively();
+	testLocalRunLoopResumesAsyncMutexWaiters();
+	testLocalRunLoopCapturingResumptionsKeepsStackDepthConstant();
+	testLocalRunLoopStopsCapturingResumptionsWhenDestroyed();
+
+	testOffloadRunsFunctionOnExecutorThread();
+	testOffloadRethrowsExceptionAndRecordsStatistics();
+	testOffloadResumesAwaiterThroughResumer();
+
+	testEpochRetireReclaimsOnceUnreferenced();
+	testEpochGuardDelaysReclamation();
+	testHazardPointerProtectsAcrossSuspension();
+
+	testConcurrentHashMapInsertFindErase();
+	testConcurrentHashMapGrowsAndKeepsEntries();
+	testConcurrentHashMapConcurrentInsertFindEraseWhileGrowing();
+
+	testAsyncEventcountConsumerSuspendsUntilNotified();
+	testAsyncEventcountNotifyBetweenPrepareAndCommitIsNotLost();
+	testAsyncEventcountNotifyAllResumesAllWaiters();
+
+	testAtomicWaitCompletesImmediatelyIfValueDiffers();
+	testAtomicWaitResumedByNotifyOnSameAddress();
+
+	testReducerMergesPerThreadViews();
+	testReducerAppendAndHistogram();
+	testReducerTakeMovesViewsIntoResult();
+
+	testKeyedExecutorRunsSameKeyInSubmissionOrder();
+	testKeyedExecutorSerialisesKeyAcrossThreads();
 
 	return 0;
 }